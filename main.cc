@@ -2,7 +2,16 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
 #include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <string>
 #include <memory>
 #include <sstream>
@@ -10,11 +19,28 @@
 #include <algorithm>
 #include <filesystem>
 #include <format>
+#include <random>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <elf.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "slang.h"
 #include "slang-com-ptr.h"
 
+// Default size of a compute group, i.e. one tile. Can be changed per shader
+// with ShaderOptions.
 static constexpr int DISPATCH_TILE_SIZE = 8;
+static constexpr int MAX_TILE_THREADS = 1024;
 
 struct ShaderViewerConstants
 {
@@ -25,29 +51,588 @@ struct ShaderViewerConstants
     float resX, resY, resZ;
 };
 
+// Multi-pass shaders have Buffer A-D passes, each readable by the others
+// through iChannel0-3.
+static constexpr int MAX_CHANNELS = 4;
+static constexpr int MAX_BUFFER_PASSES = 4;
+// Buffer passes store texels in 8x8 tiles, so that samples around a pixel
+// mostly stay within a few cache lines.
+static constexpr int TEXEL_TILE_SIZE = 8;
+
+// Same layout as StructuredBuffer<float4> in Slang's CPU target.
+struct RunnerChannel
+{
+    const float* data = nullptr;
+    // In float4 texels, 0 for an unbound channel.
+    size_t count = 0;
+};
+
 struct RunnerGlobalParams
 {
     ShaderViewerConstants* constants;
+    RunnerChannel channels[MAX_CHANNELS];
+    // Buffer passes write float4 texels here instead, counted in texels.
     uint32_t* pixelData;
     size_t pixelDataSize;
 };
 
+// Sessions are kept around between shader builds, so that the glsl module and
+// whatever else Slang caches internally only gets loaded once per option set.
+struct ShaderSession
+{
+    Slang::ComPtr<slang::ISession> session;
+    slang::IModule* glslModule = nullptr;
+    // Every build gets a unique module name, Slang won't reload an already
+    // loaded module.
+    int moduleCounter = 0;
+};
+
+// Modules can't be unloaded from a session, so with hot reloading it's
+// recreated after this many builds to not grow forever.
+static constexpr int MAX_SESSION_MODULES = 32;
+
 typedef void (*computeGroupEntryPoint)(
     int groupID[3],
     void* entryPointParams,
     RunnerGlobalParams* globalParams);
 
-struct ViewerResources
+// Things that change how the runner is built, beyond the shader source.
+struct ShaderOptions
+{
+    int tileWidth = DISPATCH_TILE_SIZE;
+    int tileHeight = DISPATCH_TILE_SIZE;
+    // The runner writes pixels in this format, which is the window surface's
+    // format when it's one that we know how to pack.
+    SDL_PixelFormat pixelFormat = SDL_PIXELFORMAT_ABGR8888;
+
+    // Code generation, set with the 'option' benchmark command.
+    int optimization = SLANG_OPTIMIZATION_LEVEL_MAXIMAL;
+    int floatingPointMode = SLANG_FLOATING_POINT_MODE_FAST;
+    int denormalMode = SLANG_FP_DENORM_MODE_ANY;
+    int emitCPU = SLANG_EMIT_CPU_VIA_LLVM;
+    // Passed to LLVM, empty for none.
+    std::string downstreamArgs = "-vector-library=AMDLIBM";
+    // Target CPU and features of the generated C++, empty for the default.
+    // Only with emit-cpu cpp, see getDownstreamArgs().
+    std::string targetCPU;
+    std::string targetFeatures;
+    // Asks LLVM for vectorizer remarks and stores them in the shader.
+    bool captureRemarks = false;
+    // Renders a Buffer pass of a multi-pass shader, which writes float4
+    // texels instead of packed pixels.
+    bool bufferPass = false;
+    // Stores each 8x8 tile of the framebuffer in 256 contiguous bytes instead
+    // of row-major, set with 'option layout tiled'. Only benchmarks handle
+    // tiled framebuffers.
+    bool tiledFramebuffer = false;
+};
+
+struct ShaderOptionValue
+{
+    const char* name;
+    int value;
+};
+
+static const ShaderOptionValue OPTIMIZATION_LEVELS[] = {
+    {"none", SLANG_OPTIMIZATION_LEVEL_NONE},
+    {"default", SLANG_OPTIMIZATION_LEVEL_DEFAULT},
+    {"high", SLANG_OPTIMIZATION_LEVEL_HIGH},
+    {"maximal", SLANG_OPTIMIZATION_LEVEL_MAXIMAL}
+};
+
+static const ShaderOptionValue FLOATING_POINT_MODES[] = {
+    {"default", SLANG_FLOATING_POINT_MODE_DEFAULT},
+    {"fast", SLANG_FLOATING_POINT_MODE_FAST},
+    {"precise", SLANG_FLOATING_POINT_MODE_PRECISE}
+};
+
+static const ShaderOptionValue DENORMAL_MODES[] = {
+    {"any", SLANG_FP_DENORM_MODE_ANY},
+    {"preserve", SLANG_FP_DENORM_MODE_PRESERVE},
+    {"ftz", SLANG_FP_DENORM_MODE_FTZ}
+};
+
+static const ShaderOptionValue EMIT_CPU_METHODS[] = {
+    {"llvm", SLANG_EMIT_CPU_VIA_LLVM},
+    {"cpp", SLANG_EMIT_CPU_VIA_CPP}
+};
+
+template<size_t N>
+bool findShaderOptionValue(const ShaderOptionValue (&values)[N], const std::string& name, int& value)
+{
+    for (const ShaderOptionValue& v: values)
+    {
+        if (name == v.name)
+        {
+            value = v.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+template<size_t N>
+const char* getShaderOptionName(const ShaderOptionValue (&values)[N], int value)
+{
+    for (const ShaderOptionValue& v: values)
+        if (v.value == value)
+            return v.name;
+    return "?";
+}
+
+// The clang frontend Slang uses doesn't know "native", only its driver
+// resolves that. So this picks the x86-64 microarchitecture level instead,
+// empty if there's none.
+std::string getNativeCPU()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    if (SDL_HasAVX512F())
+        return "x86-64-v4";
+    if (SDL_HasAVX2())
+        return "x86-64-v3";
+    if (SDL_HasSSE42())
+        return "x86-64-v2";
+    return "x86-64";
+#else
+    return "";
+#endif
+}
+
+// Names are as in the 'option' command. False if either one is unknown.
+bool setShaderOption(ShaderOptions& options, const std::string& name, const std::string& value)
+{
+    if (name == "optimization")
+        return findShaderOptionValue(OPTIMIZATION_LEVELS, value, options.optimization);
+    else if (name == "fp")
+        return findShaderOptionValue(FLOATING_POINT_MODES, value, options.floatingPointMode);
+    else if (name == "denormal")
+        return findShaderOptionValue(DENORMAL_MODES, value, options.denormalMode);
+    else if (name == "emit-cpu")
+        return findShaderOptionValue(EMIT_CPU_METHODS, value, options.emitCPU);
+    else if (name == "downstream")
+    {
+        options.downstreamArgs = value == "none" ? "" : value;
+        return true;
+    }
+    else if (name == "cpu")
+    {
+        if (value == "native")
+        {
+            options.targetCPU = getNativeCPU();
+            return !options.targetCPU.empty();
+        }
+        options.targetCPU = value == "default" ? "" : value;
+        return true;
+    }
+    else if (name == "features")
+    {
+        // sweep splits its values on commas, so ; works here too.
+        options.targetFeatures = value == "default" ? "" : value;
+        std::replace(options.targetFeatures.begin(), options.targetFeatures.end(), ';', ',');
+        return true;
+    }
+    else if (name == "remarks")
+    {
+        if (value != "on" && value != "off")
+            return false;
+        options.captureRemarks = value == "on";
+        return true;
+    }
+    else if (name == "layout")
+    {
+        if (value != "linear" && value != "tiled")
+            return false;
+        options.tiledFramebuffer = value == "tiled";
+        return true;
+    }
+    return false;
+}
+
+// Identifies the configuration a run was built with in exports and output.
+std::string describeShaderOptions(const ShaderOptions& options)
+{
+    return
+        "tilesize=" + std::to_string(options.tileWidth) + "x" + std::to_string(options.tileHeight) +
+        " optimization=" + getShaderOptionName(OPTIMIZATION_LEVELS, options.optimization) +
+        " fp=" + getShaderOptionName(FLOATING_POINT_MODES, options.floatingPointMode) +
+        " denormal=" + getShaderOptionName(DENORMAL_MODES, options.denormalMode) +
+        " emit-cpu=" + getShaderOptionName(EMIT_CPU_METHODS, options.emitCPU) +
+        " downstream=" + (options.downstreamArgs.empty() ? "none" : options.downstreamArgs) +
+        " cpu=" + (options.targetCPU.empty() ? "default" : options.targetCPU) +
+        " features=" + (options.targetFeatures.empty() ? "default" : options.targetFeatures) +
+        " layout=" + (options.tiledFramebuffer ? "tiled" : "linear");
+}
+
+// All arguments for the LLVM downstream compiler.
+std::string getDownstreamArgs(const ShaderOptions& options)
+{
+    std::string args;
+    auto append = [&](const std::string& arg) {
+        if (!args.empty())
+            args += " ";
+        args += arg;
+    };
+    // The direct LLVM path only knows the cl::opts of LLVM's libraries, and
+    // -mcpu and -mattr are registered by tools like llc. With emit-cpu cpp,
+    // everything goes to the clang frontend instead, so the LLVM options have
+    // their clang spelling there. compileShader() refuses cpu and features
+    // without it.
+    bool clang = options.emitCPU == SLANG_EMIT_CPU_VIA_CPP;
+    std::istringstream downstream(options.downstreamArgs);
+    for (std::string arg; downstream >> arg;)
+    {
+        if (clang && arg.rfind("-vector-library=", 0) == 0)
+            arg = "-fveclib=" + arg.substr(strlen("-vector-library="));
+        append(arg);
+    }
+    if (clang)
+    {
+        if (!options.targetCPU.empty())
+            append("-target-cpu " + options.targetCPU);
+        std::istringstream features(options.targetFeatures);
+        for (std::string feature; std::getline(features, feature, ',');)
+            if (!feature.empty())
+                append("-target-feature " + feature);
+    }
+    if (options.captureRemarks)
+    {
+        append(clang ? "-Rpass=loop-vectorize|slp-vectorizer" : "-pass-remarks=loop-vectorize|slp-vectorizer");
+        append(clang ? "-Rpass-missed=loop-vectorize|slp-vectorizer" : "-pass-remarks-missed=loop-vectorize|slp-vectorizer");
+    }
+    return args;
+}
+
+// Bit offsets of 8-bit channels within a 32-bit pixel. SDL's packed formats
+// are defined on the 32-bit value, so these don't depend on endianness.
+struct PixelPacking
+{
+    int rShift = 0;
+    int gShift = 8;
+    int bShift = 16;
+    int aShift = 24;
+};
+
+bool getPixelPacking(SDL_PixelFormat format, PixelPacking& packing)
+{
+    // Formats with X instead of A get alpha in the padding, which is ignored.
+    static const std::pair<SDL_PixelFormat, PixelPacking> packings[] = {
+        {SDL_PIXELFORMAT_ABGR8888, {0, 8, 16, 24}},
+        {SDL_PIXELFORMAT_XBGR8888, {0, 8, 16, 24}},
+        {SDL_PIXELFORMAT_ARGB8888, {16, 8, 0, 24}},
+        {SDL_PIXELFORMAT_XRGB8888, {16, 8, 0, 24}},
+        {SDL_PIXELFORMAT_RGBA8888, {24, 16, 8, 0}},
+        {SDL_PIXELFORMAT_RGBX8888, {24, 16, 8, 0}},
+        {SDL_PIXELFORMAT_BGRA8888, {8, 16, 24, 0}},
+        {SDL_PIXELFORMAT_BGRX8888, {8, 16, 24, 0}}
+    };
+    for (auto [f, p]: packings)
+    {
+        if (f == format)
+        {
+            packing = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t packPixel(const PixelPacking& packing, uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+{
+    return (r << packing.rShift) | (g << packing.gShift) | (b << packing.bShift) | (a << packing.aShift);
+}
+
+// Which of ShaderViewerConstants the shader source refers to.
+enum ShaderInput: uint32_t
+{
+    SHADER_INPUT_TIME = 1 << 0,
+    SHADER_INPUT_FRAME = 1 << 1,
+    SHADER_INPUT_MOUSE = 1 << 2,
+    SHADER_INPUT_RESOLUTION = 1 << 3,
+    SHADER_INPUT_ALL = 0xF
+};
+
+// Owns whatever the entry point of one built shader lives in.
+struct CompiledShader
+{
+    Slang::ComPtr<ISlangSharedLibrary> sharedLibrary;
+    // Set instead of sharedLibrary when loaded from the shader cache.
+    SDL_SharedObject* cachedObject = nullptr;
+    computeGroupEntryPoint entryPointFunc = nullptr;
+    int tileWidth = DISPATCH_TILE_SIZE;
+    int tileHeight = DISPATCH_TILE_SIZE;
+    SDL_PixelFormat pixelFormat = SDL_PIXELFORMAT_ABGR8888;
+    bool tiledFramebuffer = false;
+    uint32_t inputs = SHADER_INPUT_ALL;
+
+    // Machine code size of renderRunner_Group in bytes, only known for shaders
+    // built as shared libraries. -1 otherwise.
+    int64_t codeSize = -1;
+    // Vectorizer remarks of the build, with ShaderOptions::captureRemarks.
+    std::string remarks;
+
+    bool fromCache = false;
+    float sessionTime = 0.0f;
+
+    CompiledShader() = default;
+    CompiledShader(const CompiledShader& other) = delete;
+    CompiledShader(CompiledShader&& other) { *this = std::move(other); }
+    ~CompiledShader()
+    {
+        if (cachedObject)
+            SDL_UnloadObject(cachedObject);
+    }
+
+    CompiledShader& operator=(CompiledShader&& other)
+    {
+        std::swap(sharedLibrary, other.sharedLibrary);
+        std::swap(cachedObject, other.cachedObject);
+        std::swap(entryPointFunc, other.entryPointFunc);
+        std::swap(tileWidth, other.tileWidth);
+        std::swap(tileHeight, other.tileHeight);
+        std::swap(pixelFormat, other.pixelFormat);
+        std::swap(tiledFramebuffer, other.tiledFramebuffer);
+        std::swap(inputs, other.inputs);
+        std::swap(codeSize, other.codeSize);
+        std::swap(remarks, other.remarks);
+        std::swap(fromCache, other.fromCache);
+        std::swap(sessionTime, other.sessionTime);
+        return *this;
+    }
+};
+
+// Buffer A-D of a multi-pass shader.
+struct BufferPass
+{
+    CompiledShader shader;
+    // Index of the buffer pass bound to each iChannel, -1 for none.
+    int channels[MAX_CHANNELS] = {-1, -1, -1, -1};
+    // Ping-ponged between frames, data[current] is written this frame. Passes
+    // reading a buffer that comes later (or themselves) get the other one,
+    // i.e. the previous frame.
+    std::vector<float> data[2];
+    int current = 0;
+    RunnerGlobalParams params;
+};
+
+// Set for shaders loaded from a .passes file, the Image pass is the one in
+// ViewerResources::shader.
+struct MultipassShader
 {
-    SDL_Window* window;
-    SDL_Surface* surf;
+    // In ShaderToy's order A, B, C, D.
+    std::vector<BufferPass> buffers;
+    int imageChannels[MAX_CHANNELS] = {-1, -1, -1, -1};
+    // Passes in the same level don't read each other's output from this
+    // frame, so they're dispatched together.
+    std::vector<std::vector<int>> levels;
+
+    // Resolution the buffers are allocated for, they start over from zero
+    // when it changes.
+    int width = 0;
+    int height = 0;
+};
+
+enum class TileScheduler
+{
+    OMP,
+    STEAL
+};
+
+struct ViewerResources;
+
+typedef void (*TileFunc)(ViewerResources& res, int xTile, int yTile);
+
+// Renders only every step:th tile in both directions, starting from the
+// offset. Used for progressive refinement, the default renders all tiles.
+struct TileSubset
+{
+    int step = 1;
+    int offsetX = 0;
+    int offsetY = 0;
+
+    bool operator==(const TileSubset& other) const = default;
+};
+
+// Persistent threads for TileScheduler::STEAL. Every worker owns a range of
+// tile chunks in Morton order, and steals half of someone else's remaining
+// range when it runs out.
+struct StealingThreadPool
+{
+    struct alignas(64) Worker
+    {
+        // Chunk range [begin, end) with begin in the low 32 bits, so that both
+        // the owner and thieves can update it with a single CAS.
+        std::atomic<uint64_t> range;
+    };
+
+    int workerCount = 0;
+    std::unique_ptr<Worker[]> workers;
+    // The calling thread is worker 0, so this has workerCount-1 threads.
+    std::vector<std::thread> threads;
+    // OS thread IDs of the threads above, for perf counters.
+    std::vector<int> threadIds;
+    int startedThreads = 0;
+
+    std::mutex mutex;
+    std::condition_variable startCv;
+    std::condition_variable doneCv;
+    uint64_t generation = 0;
+    int busyThreads = 0;
+    bool quit = false;
+
+    // Tile coordinates packed as x | y << 16, sorted in Morton order.
+    std::vector<uint32_t> tileOrder;
+    int orderXTiles = 0;
+    int orderYTiles = 0;
+    TileSubset orderSubset;
+    int chunkSize = 1;
+
+    ViewerResources* res = nullptr;
+    TileFunc tileFunc = nullptr;
+};
 
+// Per-tile render times, accumulated over frames.
+struct TileTiming
+{
+    bool enabled = false;
+    int xTiles = 0;
+    int yTiles = 0;
+    int tileWidth = 0;
+    int tileHeight = 0;
+    int frames = 0;
+    // In SDL performance counter ticks. Each tile is only rendered by one
+    // thread at a time, so these don't need to be atomic. But neighbouring
+    // tiles are rendered by different threads, so each gets its own cache
+    // line to not slow down what it measures.
+    struct alignas(64) Ticks
+    {
+        uint64_t value = 0;
+    };
+    std::vector<Ticks> ticks;
+};
+
+struct PerfCounterDesc
+{
+    std::string name;
+    uint32_t type;
+    uint64_t config;
+};
+
+// Hardware performance counters of the render threads, Linux only.
+struct PerfCounters
+{
+    bool enabled = false;
+    std::vector<PerfCounterDesc> descs;
+    // One per render thread and counter, -1 if it couldn't be opened.
+    std::vector<int> fds;
+    int threadCount = 0;
+};
+
+// Everything needed to build shaders. Slang isn't thread-safe, so each thread
+// that builds shaders concurrently with others needs its own one of these.
+struct ShaderCompiler
+{
+    // Created by getGlobalSession() on the first build that needs it.
     Slang::ComPtr<slang::IGlobalSession> globalSession;
-    Slang::ComPtr<slang::ISession> session;
+    float globalSessionTime = -1.0f;
+    std::map<uint64_t, ShaderSession> sessions;
+
+    // Compiled shaders are stored in and loaded from this directory as shared
+    // libraries, if it's not empty.
+    std::string cacheDir;
+};
+
+// Converts finished frames into the window surface on its own thread, while
+// the render threads work on the next frame. SDL video calls stay on the
+// main thread, so the window update itself happens in acquireFramebuffer().
+struct FramePresenter
+{
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool quit = false;
+
+    // Left uninitialized, so that benchmarks can first-touch them.
+    std::vector<std::unique_ptr<uint32_t[]>> buffers;
+    std::vector<size_t> bufferSizes;
+    // What the shader that rendered each buffer packed the pixels as, and
+    // whether it was tiled.
+    std::vector<SDL_PixelFormat> bufferFormats;
+    std::vector<bool> bufferTiled;
+    std::vector<int> freeBuffers;
+    // Rendered frames waiting for conversion, oldest first.
+    std::vector<int> queued;
+    // The surface holds a converted frame that hasn't been shown yet, the
+    // next conversion has to wait for it.
+    bool awaitingUpdate = false;
+    // Being rendered by the main thread.
+    int current = -1;
+};
+
+enum class FrameCapture
+{
+    OFF,
+    FINAL,
+    EVERY
+};
+
+// Set with the capture, dump and golden benchmark commands, checks what the
+// following runs render.
+struct OutputCheck
+{
+    FrameCapture capture = FrameCapture::OFF;
+    // Final frames are written here as BMPs, empty for none.
+    std::string dumpDir;
+    int dumpCount = 0;
+    // Final frames are compared to this BMP and must be at least minPSNR dB
+    // from it, empty for none.
+    std::string goldenPath;
+    double minPSNR = 40.0;
+    int mismatches = 0;
+};
+
+struct ViewerResources
+{
+    // In headless mode, window and surf stay null and nothing touches SDL
+    // video. The render resolution is always width x height.
+    bool headless = false;
+    int width = 1280;
+    int height = 720;
+    SDL_Window* window = nullptr;
+    SDL_Surface* surf = nullptr;
+
+    // Only one thread may use this at a time, it isn't protected.
+    ShaderCompiler compiler;
     Slang::ComPtr<slang::IEntryPoint> entryPoint;
-    Slang::ComPtr<ISlangSharedLibrary> sharedLibrary;
 
-    computeGroupEntryPoint entryPointFunc = nullptr;
+    // The shader being rendered. Only replaced between frames, so render
+    // threads never see it change under them.
+    CompiledShader shader;
+    // Buffer passes, if the shader has any.
+    std::unique_ptr<MultipassShader> multipass;
+
+    // Used for the next shader build.
+    ShaderOptions shaderOptions;
+
+    TileScheduler scheduler = TileScheduler::OMP;
+    std::unique_ptr<StealingThreadPool> stealPool;
+    // Frames rendered per parallel region in benchmarks, set with 'batch'.
+    int frameBatch = 1;
+
+    // 0 uses all hardware threads. Render thread i is pinned to
+    // pinnedCpus[i % pinnedCpus.size()], unless it's empty.
+    int threadCount = 0;
+    std::vector<int> pinnedCpus;
+
+    TileSubset tileSubset;
+
+    TileTiming tileTiming;
+    PerfCounters perfCounters;
+    OutputCheck outputCheck;
+
+    // Number of framebuffers used for pipelined presenting, 1 presents
+    // synchronously after rendering.
+    int presentBuffers = 1;
+    std::unique_ptr<FramePresenter> presenter;
 
     std::unique_ptr<ShaderViewerConstants> constants;
     RunnerGlobalParams globalParams;
@@ -60,674 +645,5271 @@ void panic(Args&&... args)
     exit(1);
 }
 
-ViewerResources init()
+// Creating it loads the core module, which takes a good while. That's wasted
+// on lists that fail early and builds that hit the cache.
+slang::IGlobalSession* getGlobalSession(ShaderCompiler& compiler)
+{
+    if (!compiler.globalSession)
+    {
+        uint64_t startTicks = SDL_GetTicksNS();
+        SlangGlobalSessionDesc desc = {};
+        desc.enableGLSL = true;
+        if (slang::createGlobalSession(&desc, compiler.globalSession.writeRef()) != SLANG_OK)
+            panic("Failed to init Slang session\n");
+        compiler.globalSessionTime = (SDL_GetTicksNS() - startTicks) * 1e-9;
+    }
+    return compiler.globalSession.get();
+}
+
+// Makes shaders write pixels in the window surface's format, so that they
+// can render straight into it.
+void matchSurfaceFormat(ViewerResources& res)
+{
+    PixelPacking packing;
+    if (res.surf && getPixelPacking(res.surf->format, packing))
+        res.shaderOptions.pixelFormat = res.surf->format;
+    else
+        res.shaderOptions.pixelFormat = SDL_PIXELFORMAT_ABGR8888;
+}
+
+ViewerResources init(bool headless = false)
 {
     ViewerResources res;
+    res.headless = headless;
 
-    if (!SDL_Init(SDL_INIT_EVENTS|SDL_INIT_VIDEO))
+    // Events are still initialized when headless, they don't need a display
+    // and we get SDL_EVENT_QUIT on Ctrl+C from them.
+    if (!SDL_Init(headless ? SDL_INIT_EVENTS : SDL_INIT_EVENTS|SDL_INIT_VIDEO))
         panic("Can't init, yikes. %s\n", SDL_GetError());
 
-    res.window = SDL_CreateWindow("CPU shader viewer", 1280, 720, 0);
-
-    if (!res.window)
-        panic("Can't open window, yikes. %s\n", SDL_GetError());
+    if (!headless)
+    {
+        res.window = SDL_CreateWindow("CPU shader viewer", res.width, res.height, 0);
 
-    res.surf = SDL_GetWindowSurface(res.window);
-    if (!res.surf)
-        panic("Can't get window surface, yikes. %s\n", SDL_GetError());
-    SDL_ClearSurface(res.surf, 0, 0, 0, 0);
+        if (!res.window)
+            panic("Can't open window, yikes. %s\n", SDL_GetError());
 
-    SlangGlobalSessionDesc desc = {};
-    desc.enableGLSL = true;
-    if (slang::createGlobalSession(&desc, res.globalSession.writeRef()) != SLANG_OK)
-        panic("Failed to init Slang session\n");
+        res.surf = SDL_GetWindowSurface(res.window);
+        if (!res.surf)
+            panic("Can't get window surface, yikes. %s\n", SDL_GetError());
+        SDL_ClearSurface(res.surf, 0, 0, 0, 0);
+        matchSurfaceFormat(res);
+    }
 
     res.constants.reset(new ShaderViewerConstants);
     res.globalParams.constants = res.constants.get();
     return res;
 }
 
+void stopStealingThreadPool(ViewerResources& res);
+void stopFramePresenter(ViewerResources& res);
+void pinCurrentThread(int cpu);
+void drainFramePresenter(ViewerResources& res, size_t size);
+
 void deinit(ViewerResources& res)
 {
-    SDL_DestroyWindow(res.window);
+    stopFramePresenter(res);
+    stopStealingThreadPool(res);
+    res.shader = CompiledShader();
+    res.multipass.reset();
+    if (res.window)
+        SDL_DestroyWindow(res.window);
     SDL_Quit();
 }
 
 void setResolution(ViewerResources& res, int w, int h)
 {
+    res.width = w;
+    res.height = h;
+
+    if (res.headless)
+        return;
+
+    // The presenter thread may still be converting into the old surface.
+    if (res.presenter)
+        drainFramePresenter(res, 0);
+
     SDL_SetWindowSize(res.window, w, h);
     SDL_PumpEvents();
     res.surf = SDL_GetWindowSurface(res.window);
     SDL_ClearSurface(res.surf, 0, 0, 0, 0);
     SDL_UpdateWindowSurface(res.window);
     SDL_UpdateWindowSurface(res.window);
+    matchSurfaceFormat(res);
+
+    // The window manager may not give us the size we asked for.
+    res.width = res.surf->w;
+    res.height = res.surf->h;
 }
 
-std::string readTextFile(const char* path)
+// Buffer pass texels and tiled framebuffers are in TEXEL_TILE_SIZE squares,
+// which are stored one after the other, row by row.
+size_t getTiledTexelCount(int width, int height)
 {
-    FILE* f = fopen(path, "rb");
+    size_t xTiles = (width + TEXEL_TILE_SIZE - 1) / TEXEL_TILE_SIZE;
+    size_t yTiles = (height + TEXEL_TILE_SIZE - 1) / TEXEL_TILE_SIZE;
+    return xTiles * yTiles * TEXEL_TILE_SIZE * TEXEL_TILE_SIZE;
+}
 
-    if(!f) panic("Unable to open %s\n", path);
+int getTiledPitch(int width)
+{
+    return (width + TEXEL_TILE_SIZE - 1) / TEXEL_TILE_SIZE * TEXEL_TILE_SIZE;
+}
 
-    fseek(f, 0, SEEK_END);
-    size_t sz = ftell(f);
-    fseek(f, 0, SEEK_SET);
+inline size_t getTiledPixelIndex(int x, int y, int pitch)
+{
+    const int n = TEXEL_TILE_SIZE;
+    return (size_t(y / n) * (pitch / n) + x / n) * n * n + (y % n) * n + x % n;
+}
 
-    char* data = new char[sz];
-    if(fread(data, 1, sz, f) != sz)
+// Copies rows [y0, y0 + rows) of a tiled framebuffer into a linear one.
+void detileRows(const uint32_t* tiled, int pitch, int width, int y0, int rows, uint32_t* out, int outPitch)
+{
+    const int n = TEXEL_TILE_SIZE;
+    for (int y = y0; y < y0 + rows; ++y)
     {
-        fclose(f);
-        delete [] data;
-        panic("Unable to read %s\n", path);
+        const uint32_t* src = tiled + getTiledPixelIndex(0, y, pitch);
+        uint32_t* dst = out + size_t(y - y0) * outPitch;
+        for (int x = 0; x < width; x += n)
+            memcpy(dst + x, src + size_t(x / n) * n * n, std::min(n, width - x) * sizeof(uint32_t));
     }
-    fclose(f);
-    std::string ret(data, sz);
-
-    delete [] data;
-    return ret;
 }
 
-bool isPathToGLSL(const char* path)
+// The surface must be locked. A tiled frame is detiled one row of tiles at a
+// time on the way, so there's never a linear copy of the whole frame.
+void convertFramebuffer(SDL_Surface* surf, const uint32_t* framebuffer, SDL_PixelFormat format, bool tiled)
 {
-    return std::filesystem::path(path).extension().string() == ".glsl";
+    if (!tiled)
+    {
+        SDL_ConvertPixels(
+            surf->w, surf->h, format, framebuffer,
+            surf->w * 4, surf->format, surf->pixels, surf->pitch);
+        return;
+    }
+
+    int pitch = getTiledPitch(surf->w);
+    thread_local std::vector<uint32_t> band;
+    for (int y = 0; y < surf->h; y += TEXEL_TILE_SIZE)
+    {
+        int rows = std::min(TEXEL_TILE_SIZE, surf->h - y);
+        uint8_t* dst = (uint8_t*)surf->pixels + size_t(y) * surf->pitch;
+        if (format == surf->format && surf->pitch % 4 == 0)
+            detileRows(framebuffer, pitch, surf->w, y, rows, (uint32_t*)dst, surf->pitch / 4);
+        else
+        {
+            band.resize(size_t(surf->w) * TEXEL_TILE_SIZE);
+            detileRows(framebuffer, pitch, surf->w, y, rows, band.data(), surf->w);
+            SDL_ConvertPixels(
+                surf->w, rows, format, band.data(), surf->w * 4,
+                surf->format, dst, surf->pitch);
+        }
+    }
 }
 
-bool loadShaderFromSource(ViewerResources& res, const char* shaderSource, bool allowGLSL)
+void presentFramebuffer(ViewerResources& res, const uint32_t* framebuffer)
 {
-    res.entryPointFunc = nullptr;
+    if (res.headless)
+        return;
 
-    std::string source;
-    source = R"(
-struct ShaderViewerConstants
-{
-    float time;
-    int frame;
-    uint pitch;
-    float4 mouse;
-    float3 res;
-};
+    SDL_LockSurface(res.surf);
+    convertFramebuffer(res.surf, framebuffer, res.shader.pixelFormat, res.shader.tiledFramebuffer);
+    SDL_UnlockSurface(res.surf);
 
-ConstantBuffer<ShaderViewerConstants, CDataLayout> shaderViewerConstants;
+    SDL_UpdateWindowSurface(res.window);
+}
 
-#define iResolution shaderViewerConstants.res
-#define iFrame shaderViewerConstants.frame
-#define iMouse shaderViewerConstants.mouse
-#define iTime shaderViewerConstants.time
-)";
+// True when the current shader can render straight into the window surface,
+// skipping the conversion in presentFramebuffer().
+bool canRenderToSurface(ViewerResources& res)
+{
+    return !res.headless && !res.presenter && res.surf && !res.shader.tiledFramebuffer &&
+        res.shader.pixelFormat == res.surf->format && res.surf->pitch % 4 == 0;
+}
 
-    source += shaderSource;
+void framePresenterThread(ViewerResources& res, FramePresenter& presenter)
+{
+    pinCurrentThread(-1);
+    std::unique_lock<std::mutex> lock(presenter.mutex);
+    for (;;)
+    {
+        presenter.cv.wait(lock, [&]{
+            return presenter.quit || (presenter.queued.size() != 0 && !presenter.awaitingUpdate);
+        });
+        if (presenter.quit)
+            break;
+
+        int index = presenter.queued[0];
+        presenter.queued.erase(presenter.queued.begin());
+        SDL_PixelFormat format = presenter.bufferFormats[index];
+        bool tiled = presenter.bufferTiled[index];
+        lock.unlock();
 
-    source += R"(
-RWStructuredBuffer<uint32_t> pixelData;
-)";
+        SDL_LockSurface(res.surf);
+        convertFramebuffer(res.surf, presenter.buffers[index].get(), format, tiled);
+        SDL_UnlockSurface(res.surf);
 
-    std::string numStr = std::to_string(DISPATCH_TILE_SIZE);
-    source += "[numthreads(" + numStr + ", " + numStr + ", 1)]";
+        lock.lock();
+        presenter.freeBuffers.push_back(index);
+        presenter.awaitingUpdate = true;
+        presenter.cv.notify_all();
+    }
+}
 
-    source += R"(
-void renderRunner(
-    uint3 dispatchThreadID : SV_DispatchThreadID,
-    uint3 groupThreadID : SV_GroupThreadID)
+// Does nothing in headless mode or with fewer than 2 buffers, rendering then
+// presents synchronously.
+void startFramePresenter(ViewerResources& res, int bufferCount)
 {
-    float4 color = float4(1);
-    float2 p = float2(dispatchThreadID.xy) + float2(0.5);
-    p.y = shaderViewerConstants.res.y - p.y;
-    mainImage(color, p);
-
-    uint i = dispatchThreadID.x + dispatchThreadID.y * shaderViewerConstants.pitch;
-    uint4 ucolor = uint4(saturate(color) * 255);
-    pixelData[i] = (ucolor.a << 24) | (ucolor.b << 16) | (ucolor.g << 8) | ucolor.r;
+    stopFramePresenter(res);
+    res.presentBuffers = bufferCount;
+    if (res.headless || bufferCount < 2)
+        return;
+
+    res.presenter.reset(new FramePresenter);
+    FramePresenter& presenter = *res.presenter;
+    presenter.buffers.resize(bufferCount);
+    presenter.bufferSizes.resize(bufferCount, 0);
+    presenter.bufferFormats.resize(bufferCount, SDL_PIXELFORMAT_ABGR8888);
+    presenter.bufferTiled.resize(bufferCount, false);
+    for (int i = 0; i < bufferCount; ++i)
+        presenter.freeBuffers.push_back(i);
+    presenter.thread = std::thread(framePresenterThread, std::ref(res), std::ref(presenter));
 }
-)";
 
-    //printf("%s\n", source.c_str());
+// Frames that are still queued are dropped.
+void stopFramePresenter(ViewerResources& res)
+{
+    if (!res.presenter)
+        return;
 
-    slang::CompilerOptionEntry options[] = {
-        {slang::CompilerOptionName::AllowGLSL, {{}, allowGLSL ? 1 : 0}},
-        {slang::CompilerOptionName::EmitCPUMethod, {{}, SLANG_EMIT_CPU_VIA_LLVM}},
-        {slang::CompilerOptionName::Optimization, {{}, SLANG_OPTIMIZATION_LEVEL_MAXIMAL}},
-        {slang::CompilerOptionName::FloatingPointMode, {{}, SLANG_FLOATING_POINT_MODE_FAST}},
-        {slang::CompilerOptionName::DenormalModeFp16, {{}, SLANG_FP_DENORM_MODE_ANY}},
-        {slang::CompilerOptionName::DenormalModeFp32, {{}, SLANG_FP_DENORM_MODE_ANY}},
-        {slang::CompilerOptionName::DenormalModeFp64, {{}, SLANG_FP_DENORM_MODE_ANY}},
-        {slang::CompilerOptionName::DownstreamArgs, {{}, 0, 0, "llvm", "-vector-library=AMDLIBM"}}
-        //{slang::CompilerOptionName::DumpIr, {{}, 1}}
-    };
+    FramePresenter& presenter = *res.presenter;
+    {
+        std::lock_guard<std::mutex> lock(presenter.mutex);
+        presenter.quit = true;
+    }
+    presenter.cv.notify_all();
+    presenter.thread.join();
+    res.presenter.reset();
+}
 
-    slang::TargetDesc target = {};
-    target.format = SLANG_SHADER_HOST_CALLABLE;
-    target.compilerOptionEntries = options;
-    target.compilerOptionEntryCount = std::size(options);
+// Shows the last converted frame, if there is one.
+void updateFramePresenter(ViewerResources& res, std::unique_lock<std::mutex>& lock)
+{
+    FramePresenter& presenter = *res.presenter;
+    if (!presenter.awaitingUpdate)
+        return;
 
-    slang::SessionDesc sessionDesc;
-    sessionDesc.targets = &target;
-    sessionDesc.targetCount = 1;
-    sessionDesc.allowGLSLSyntax = allowGLSL;
-    sessionDesc.compilerOptionEntries = options;
-    sessionDesc.compilerOptionEntryCount = std::size(options);
+    // The presenter thread won't touch the surface until awaitingUpdate is
+    // cleared.
+    lock.unlock();
+    SDL_UpdateWindowSurface(res.window);
+    lock.lock();
+    presenter.awaitingUpdate = false;
+    presenter.cv.notify_all();
+}
 
-    if (res.globalSession->createSession(sessionDesc, res.session.writeRef()))
+// Returns a framebuffer of at least `size` pixels to render the next frame
+// into, waiting if all of them are still being presented.
+uint32_t* acquireFramebuffer(ViewerResources& res, size_t size)
+{
+    FramePresenter& presenter = *res.presenter;
+    std::unique_lock<std::mutex> lock(presenter.mutex);
+    for (;;)
     {
-        fprintf(stderr, "Failed to open session!\n");
-        return false;
+        updateFramePresenter(res, lock);
+        if (presenter.freeBuffers.size() != 0)
+            break;
+        presenter.cv.wait(lock, [&]{
+            return presenter.freeBuffers.size() != 0 || presenter.awaitingUpdate;
+        });
     }
 
-    Slang::ComPtr<slang::IBlob> diagnosticBlob;
-    slang::IModule* module = res.session->loadModuleFromSourceString("runner", "shader.slang", source.c_str(), diagnosticBlob.writeRef());
-    if (diagnosticBlob)
-        fprintf(stderr, "%s\n", (const char*)diagnosticBlob->getBufferPointer());
-    if (!module)
+    int index = presenter.freeBuffers.back();
+    presenter.freeBuffers.pop_back();
+    presenter.current = index;
+    if (presenter.bufferSizes[index] < size)
     {
-        return false;
+        presenter.buffers[index].reset(new uint32_t[size]);
+        presenter.bufferSizes[index] = size;
     }
+    return presenter.buffers[index].get();
+}
 
-    Slang::ComPtr<slang::IEntryPoint> entryPoint;
-    module->findEntryPointByName("renderRunner", entryPoint.writeRef());
-    
-    slang::IModule* glsl;
-    if (allowGLSL)
-        glsl = res.session->loadModule("glsl");
+// Waits until every queued frame is shown, then makes sure all framebuffers
+// have at least `size` pixels.
+void drainFramePresenter(ViewerResources& res, size_t size)
+{
+    FramePresenter& presenter = *res.presenter;
+    std::unique_lock<std::mutex> lock(presenter.mutex);
+    while (presenter.freeBuffers.size() != presenter.buffers.size() || presenter.awaitingUpdate)
+    {
+        updateFramePresenter(res, lock);
+        presenter.cv.wait(lock, [&]{
+            return presenter.freeBuffers.size() == presenter.buffers.size() || presenter.awaitingUpdate;
+        });
+    }
 
-    slang::IComponentType* components[] = {module, entryPoint, glsl};
-    Slang::ComPtr<slang::IComponentType> program;
-    SlangResult err = res.session->createCompositeComponentType(
-        components,
-        allowGLSL ? 3 : 2,
-        program.writeRef(),
-        diagnosticBlob.writeRef());
-    if (diagnosticBlob)
-        fprintf(stderr, "%s\n", (const char*)diagnosticBlob->getBufferPointer());
-    if (err != SLANG_OK)
+    for (size_t i = 0; i < presenter.buffers.size(); ++i)
     {
-        return false;
+        if (presenter.bufferSizes[i] < size)
+        {
+            presenter.buffers[i].reset(new uint32_t[size]);
+            presenter.bufferSizes[i] = size;
+        }
     }
+}
 
-    if (program->getEntryPointHostCallable(
-            0,
-            0,
-            res.sharedLibrary.writeRef(),
-            diagnosticBlob.writeRef()) != SLANG_OK)
+void submitFramebuffer(ViewerResources& res)
+{
+    FramePresenter& presenter = *res.presenter;
     {
-        fprintf(stderr, "%s\n", (const char*)diagnosticBlob->getBufferPointer());
-        return false;
+        std::lock_guard<std::mutex> lock(presenter.mutex);
+        presenter.bufferFormats[presenter.current] = res.shader.pixelFormat;
+        presenter.bufferTiled[presenter.current] = res.shader.tiledFramebuffer;
+        presenter.queued.push_back(presenter.current);
+        presenter.current = -1;
     }
+    presenter.cv.notify_all();
+}
+
+// The watched file can be briefly missing while an editor saves it, so
+// shader builds use this and fail instead of exiting.
+bool tryReadTextFile(const char* path, std::string& out)
+{
+    FILE* f = fopen(path, "rb");
+
+    if(!f) return false;
 
-    res.entryPointFunc =
-        (computeGroupEntryPoint)res.sharedLibrary->findFuncByName("renderRunner_Group");
-    if (!res.entryPointFunc)
+    fseek(f, 0, SEEK_END);
+    long sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if(sz < 0)
     {
-        fprintf(stderr, "Failed to find entry point!\n");
+        fclose(f);
         return false;
     }
-    return true;
+    out.resize(sz);
+    bool ok = fread(out.data(), 1, sz, f) == (size_t)sz;
+    fclose(f);
+    return ok;
 }
 
-bool loadShader(ViewerResources& res, const char* path)
+std::string readTextFile(const char* path)
 {
-    bool status = path ? 
-        loadShaderFromSource(res, readTextFile(path).c_str(), isPathToGLSL(path)) : false;
-    if (!status)
-    {
-        const char* fallbackSource = R"(
-void mainImage(out vec4 fragColor, in vec2 fragCoord)
+    std::string ret;
+    if(!tryReadTextFile(path, ret))
+        panic("Unable to read %s\n", path);
+    return ret;
+}
+
+bool isPathToGLSL(const char* path)
 {
-    fragColor = vec4(1.0,0.0,0.0,1.0);
+    return std::filesystem::path(path).extension().string() == ".glsl";
 }
-)";
-        loadShaderFromSource(res, fallbackSource, true);
+
+void writeBinaryFile(const char* path, const void* data, size_t size)
+{
+    FILE* f = fopen(path, "wb");
+
+    if(!f) panic("Unable to open %s\n", path);
+
+    if(fwrite(data, 1, size, f) != size)
+    {
+        fclose(f);
+        panic("Unable to write %s\n", path);
     }
-    return status;
+    fclose(f);
 }
 
-void renderTile(ViewerResources& res, int xTile, int yTile)
+// FNV-1a, it only needs to be stable across runs, not secure.
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
 {
-    if (res.entryPointFunc)
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i)
     {
-        int gid[3] = {xTile, yTile, 0};
-        res.entryPointFunc(gid, nullptr, &res.globalParams);
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
     }
+    return hash;
 }
 
-void renderFrameMultithread(ViewerResources& res, int width, int height)
+uint64_t hashString(uint64_t hash, const char* str)
 {
-    int xTiles = (width + DISPATCH_TILE_SIZE - 1) / DISPATCH_TILE_SIZE;
-    int yTiles = (height + DISPATCH_TILE_SIZE - 1) / DISPATCH_TILE_SIZE;
-
-    #pragma omp parallel for collapse(2) schedule(dynamic,1)
-    for (int y = 0; y < yTiles; ++y)
-    for (int x = 0; x < xTiles; ++x)
-        renderTile(res, x, y);
+    // Includes the terminator so that consecutive strings can't alias.
+    return str ? hashBytes(hash, str, strlen(str)+1) : hashBytes(hash, "", 1);
 }
 
-void renderFrameSinglethread(ViewerResources& res, int width, int height)
-{
-    int xTiles = (width + DISPATCH_TILE_SIZE - 1) / DISPATCH_TILE_SIZE;
-    int yTiles = (height + DISPATCH_TILE_SIZE - 1) / DISPATCH_TILE_SIZE;
+static constexpr uint64_t HASH_SEED = 0xcbf29ce484222325ull;
 
-    for (int y = 0; y < yTiles; ++y)
-    for (int x = 0; x < xTiles; ++x)
-        renderTile(res, x, y);
+uint64_t hashCompilerOptions(
+    uint64_t hash,
+    const slang::CompilerOptionEntry* options,
+    size_t optionCount
+){
+    for (size_t i = 0; i < optionCount; ++i)
+    {
+        const slang::CompilerOptionEntry& entry = options[i];
+        int32_t ints[] = {
+            (int32_t)entry.name,
+            (int32_t)entry.value.kind,
+            entry.value.intValue0,
+            entry.value.intValue1
+        };
+        hash = hashBytes(hash, ints, sizeof(ints));
+        hash = hashString(hash, entry.value.stringValue0);
+        hash = hashString(hash, entry.value.stringValue1);
+    }
+    return hash;
 }
 
-void printUsage(FILE* out, char* programName)
-{
-    fprintf(out,
-        "Usage: %s [benchmark-command-list-file]\n"
-        "Check the README for how the benchmark command list works.\n",
-        programName);
+std::string getShaderCachePath(
+    ShaderCompiler& compiler,
+    const ShaderOptions& shaderOptions,
+    const std::string& source,
+    const slang::CompilerOptionEntry* options,
+    size_t optionCount
+){
+    uint64_t hash = HASH_SEED;
+    hash = hashString(hash, spGetBuildTagString());
+    hash = hashBytes(hash, &shaderOptions.tileWidth, sizeof(shaderOptions.tileWidth));
+    hash = hashBytes(hash, &shaderOptions.tileHeight, sizeof(shaderOptions.tileHeight));
+    hash = hashCompilerOptions(hash, options, optionCount);
+    hash = hashString(hash, source.c_str());
+
+#if defined(_WIN32)
+    const char* suffix = ".dll";
+#elif defined(__APPLE__)
+    const char* suffix = ".dylib";
+#else
+    const char* suffix = ".so";
+#endif
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    return (std::filesystem::path(compiler.cacheDir) / (name + std::string(suffix))).string();
 }
 
-void interactiveMain()
+bool loadCachedShader(const std::string& path, CompiledShader& out)
 {
-    ViewerResources res = init();
-    loadShader(res, nullptr);
+    SDL_SharedObject* obj = SDL_LoadObject(path.c_str());
+    if (!obj)
+        return false;
 
-    uint64_t prevTicks = SDL_GetTicksNS();
-    uint64_t epochTicks = prevTicks;
+    computeGroupEntryPoint func =
+        (computeGroupEntryPoint)SDL_LoadFunction(obj, "renderRunner_Group");
+    if (!func)
+    {
+        SDL_UnloadObject(obj);
+        return false;
+    }
 
-    std::string activeShaderPath = "";
-    SDL_Time shaderModifyTime;
+    out.cachedObject = obj;
+    out.entryPointFunc = func;
+    return true;
+}
 
-    std::vector<uint32_t> framebuffer;
+// Redirects stderr into a temporary file until finishStderrCapture(). This is
+// process-wide, so anything other threads print meanwhile ends up there too.
+// Captures on different threads wait for each other, or one could save the
+// other's temporary file as the real stderr. So builds with remarks on don't
+// generate code in parallel, even when prebuilding.
+struct StderrCapture
+{
+    FILE* file = nullptr;
+    int savedFd = -1;
+    std::unique_lock<std::mutex> lock;
+};
 
-    auto& params = *res.constants;
-    params.frame = 0;
-    params.mouseX = 0;
-    params.mouseY = 0;
-    params.mouseClickX = 0;
-    params.mouseClickY = 0;
+std::mutex stderrCaptureMutex;
 
-    bool valid = false;
+void startStderrCapture(StderrCapture& capture)
+{
+#ifdef __linux__
+    capture.lock = std::unique_lock<std::mutex>(stderrCaptureMutex);
+    fflush(stderr);
+    capture.file = tmpfile();
+    if (!capture.file)
+        return;
+    capture.savedFd = dup(2);
+    dup2(fileno(capture.file), 2);
+#endif
+}
 
-    for(;;)
+std::string finishStderrCapture(StderrCapture& capture)
+{
+    std::string text;
+#ifdef __linux__
+    if (!capture.file)
     {
-        uint64_t curTicks = SDL_GetTicksNS();
+        capture = StderrCapture();
+        return text;
+    }
 
-        float deltaTime = (curTicks - prevTicks) * 1e-9f;
-        float totalTime = (curTicks - epochTicks) * 1e-9f;
+    fflush(stderr);
+    dup2(capture.savedFd, 2);
+    close(capture.savedFd);
+
+    rewind(capture.file);
+    char buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), capture.file)) > 0;)
+        text.append(buf, n);
+    fclose(capture.file);
+    capture = StderrCapture();
+#endif
+    return text;
+}
 
-        params.time = totalTime;
-        if (valid)
-            printf("%f\n", deltaTime);
+// Size of a symbol in an ELF64 shared library, -1 if it can't be found.
+int64_t getElfSymbolSize(const std::string& elf, const char* name)
+{
+#ifdef __linux__
+    Elf64_Ehdr header;
+    if (elf.size() < sizeof(header))
+        return -1;
+    memcpy(&header, elf.data(), sizeof(header));
+    if (memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64)
+        return -1;
+    if (header.e_shoff + uint64_t(header.e_shnum) * sizeof(Elf64_Shdr) > elf.size())
+        return -1;
+
+    auto getSection = [&](int index) {
+        Elf64_Shdr section;
+        memcpy(&section, elf.data() + header.e_shoff + index * sizeof(Elf64_Shdr), sizeof(section));
+        return section;
+    };
 
-        prevTicks = curTicks;
+    for (int i = 0; i < header.e_shnum; ++i)
+    {
+        Elf64_Shdr symbols = getSection(i);
+        if ((symbols.sh_type != SHT_SYMTAB && symbols.sh_type != SHT_DYNSYM) || symbols.sh_link >= header.e_shnum)
+            continue;
+        Elf64_Shdr strings = getSection(symbols.sh_link);
+        if (symbols.sh_offset + symbols.sh_size > elf.size() || strings.sh_offset + strings.sh_size > elf.size())
+            continue;
 
-        SDL_Event event;
-        while (SDL_PollEvent(&event))
+        for (uint64_t j = 0; j < symbols.sh_size / sizeof(Elf64_Sym); ++j)
         {
-            switch (event.type)
-            {
-            case SDL_EVENT_KEY_DOWN:
-                if (event.key.key == SDLK_Q)
-                    goto end;
-                if (event.key.key == SDLK_R)
-                    epochTicks = curTicks;
-                break;
-            case SDL_EVENT_DROP_FILE:
-                {
-                    const char* path = event.drop.data;
-                    SDL_PathInfo info;
-                    if (SDL_GetPathInfo(event.drop.data, &info))
-                    {
-                        if (loadShader(res, event.drop.data))
-                        {
-                            activeShaderPath = event.drop.data;
-                            shaderModifyTime = info.modify_time;
-                            valid = true;
-                        }
-                        else valid = false;
-                    }
-                }
-                break;
-            case SDL_EVENT_QUIT:
-                goto end;
-            }
+            Elf64_Sym sym;
+            memcpy(&sym, elf.data() + symbols.sh_offset + j * sizeof(Elf64_Sym), sizeof(sym));
+            if (sym.st_name >= strings.sh_size)
+                continue;
+            const char* symName = elf.data() + strings.sh_offset + sym.st_name;
+            size_t maxLength = strings.sh_size - sym.st_name;
+            if (strlen(name) < maxLength && strncmp(symName, name, strlen(name) + 1) == 0)
+                return sym.st_size;
         }
+    }
+#endif
+    return -1;
+}
 
-        SDL_PathInfo info;
-        if (SDL_GetPathInfo(activeShaderPath.c_str(), &info))
+// Slang's reflection only tells whether the whole constant buffer is used,
+// not which fields are, so this looks for the identifiers instead. Mentions
+// in comments or dead code only cause extra renders.
+uint32_t findShaderInputs(const char* source)
+{
+    static const std::pair<const char*, uint32_t> names[] = {
+        {"iTime", SHADER_INPUT_TIME},
+        {"iFrame", SHADER_INPUT_FRAME},
+        {"iMouse", SHADER_INPUT_MOUSE},
+        {"iResolution", SHADER_INPUT_RESOLUTION},
+        {"shaderViewerConstants", SHADER_INPUT_ALL}
+    };
+
+    uint32_t inputs = 0;
+    const char* s = source;
+    while (*s)
+    {
+        if (!isalpha((unsigned char)*s) && *s != '_')
         {
-            if (shaderModifyTime < info.modify_time)
-            {
-                shaderModifyTime = info.modify_time;
-                valid = loadShader(res, activeShaderPath.c_str());
-            }
+            s++;
+            continue;
         }
 
-        framebuffer.resize(res.surf->w * res.surf->h);
+        const char* begin = s;
+        while (isalnum((unsigned char)*s) || *s == '_')
+            s++;
 
-        res.globalParams.pixelData = framebuffer.data();
-        res.globalParams.pixelDataSize = framebuffer.size();
-        params.pitch = res.surf->w;
-        params.resX = res.surf->w;
-        params.resY = res.surf->h;
-        params.resZ = 1;
+        for (auto [name, input]: names)
+            if (size_t(s - begin) == strlen(name) && strncmp(begin, name, s - begin) == 0)
+                inputs |= input;
+    }
+    return inputs;
+}
 
-        renderFrameMultithread(res, res.surf->w, res.surf->h);
+// Doesn't touch the currently rendered shader, so it's safe to call from a
+// different thread than the renderer.
+bool compileShader(
+    ShaderCompiler& compiler,
+    const char* shaderSource,
+    bool allowGLSL,
+    const ShaderOptions& shaderOptions,
+    CompiledShader& out
+){
+    out = CompiledShader();
+    out.tileWidth = shaderOptions.tileWidth;
+    out.tileHeight = shaderOptions.tileHeight;
+    out.pixelFormat = shaderOptions.pixelFormat;
+    out.tiledFramebuffer = shaderOptions.tiledFramebuffer && !shaderOptions.bufferPass;
+    out.inputs = findShaderInputs(shaderSource);
+
+    if ((!shaderOptions.targetCPU.empty() || !shaderOptions.targetFeatures.empty()) &&
+        shaderOptions.emitCPU != SLANG_EMIT_CPU_VIA_CPP)
+    {
+        fprintf(stderr, "Options cpu and features need 'option emit-cpu cpp'\n");
+        return false;
+    }
 
-        SDL_LockSurface(res.surf);
-        SDL_ConvertPixels(
-            res.surf->w, res.surf->h, SDL_PIXELFORMAT_ABGR8888, framebuffer.data(),
-            res.surf->w * 4, res.surf->format, res.surf->pixels, res.surf->pitch);
-        SDL_UnlockSurface(res.surf);
+    PixelPacking packing;
+    if (!getPixelPacking(shaderOptions.pixelFormat, packing))
+    {
+        fprintf(stderr, "Unsupported pixel format %u\n", (unsigned)shaderOptions.pixelFormat);
+        return false;
+    }
 
-        SDL_UpdateWindowSurface(res.window);
+    std::string source;
+    source = R"(
+struct ShaderViewerConstants
+{
+    float time;
+    int frame;
+    uint pitch;
+    float4 mouse;
+    float3 res;
+};
 
-        params.frame++;
-    }
+ConstantBuffer<ShaderViewerConstants, CDataLayout> shaderViewerConstants;
 
-end:
+#define iResolution shaderViewerConstants.res
+#define iFrame shaderViewerConstants.frame
+#define iMouse shaderViewerConstants.mouse
+#define iTime shaderViewerConstants.time
 
-    deinit(res);
-}
+// Buffers of a multi-pass shader. Unbound channels have no texels and read
+// as zero.
+StructuredBuffer<float4> shaderViewerChannel0;
+StructuredBuffer<float4> shaderViewerChannel1;
+StructuredBuffer<float4> shaderViewerChannel2;
+StructuredBuffer<float4> shaderViewerChannel3;
 
-void skipWhitespace(const char*& str)
+struct ShaderViewerChannel
 {
-    while(*str != 0 && strchr(" \t\n", *str)) str++;
-}
+    int index;
+};
 
-std::string readUntilWhitespace(const char*& str)
+static const ShaderViewerChannel iChannel0 = {0};
+static const ShaderViewerChannel iChannel1 = {1};
+static const ShaderViewerChannel iChannel2 = {2};
+static const ShaderViewerChannel iChannel3 = {3};
+
+// Texels are in 8x8 tiles, rows go upwards like fragCoord.
+uint shaderViewerTexelIndex(int2 p)
 {
-    std::string token;
-    while (*str != ' ' && *str != '\t' && *str)
-    {
-        token += *str;
-        str++;
-    }
-    return token;
+    p = clamp(p, int2(0), int2(shaderViewerConstants.res.xy) - 1);
+    uint tilesX = (uint(shaderViewerConstants.res.x) + 7) / 8;
+    uint2 tile = uint2(p) / 8;
+    uint2 texel = uint2(p) % 8;
+    return (tile.x + tile.y * tilesX) * 64 + texel.x + texel.y * 8;
 }
 
-bool readDouble(const std::string& str, double& d)
+float4 shaderViewerLoad(StructuredBuffer<float4> buffer, uint i)
 {
-    char* out = nullptr;
-    d = strtod(str.c_str(), &out);
-    return *out == 0;
+    uint count, stride;
+    buffer.GetDimensions(count, stride);
+    return i < count ? buffer[i] : float4(0);
 }
 
-std::vector<std::string> splitByWhitespace(const char* str)
+float4 texelFetch(ShaderViewerChannel channel, int2 p, int lod)
 {
-    std::vector<std::string> args;
-    skipWhitespace(str);
-    while (*str)
+    uint i = shaderViewerTexelIndex(p);
+    switch (channel.index)
     {
-        args.push_back(readUntilWhitespace(str));
-        skipWhitespace(str);
+    case 0: return shaderViewerLoad(shaderViewerChannel0, i);
+    case 1: return shaderViewerLoad(shaderViewerChannel1, i);
+    case 2: return shaderViewerLoad(shaderViewerChannel2, i);
+    default: return shaderViewerLoad(shaderViewerChannel3, i);
     }
-    return args;
 }
 
-float sum(const std::vector<float>& vals)
+// Bilinear with clamp to edge, like ShaderToy's default buffer sampler.
+float4 texture(ShaderViewerChannel channel, float2 uv)
 {
-    float s = 0;
-    for (float v: vals)
-        s += v;
-    return s;
+    float2 p = uv * shaderViewerConstants.res.xy - 0.5;
+    float2 f = p - floor(p);
+    int2 i = int2(floor(p));
+    float4 a = texelFetch(channel, i, 0);
+    float4 b = texelFetch(channel, i + int2(1, 0), 0);
+    float4 c = texelFetch(channel, i + int2(0, 1), 0);
+    float4 d = texelFetch(channel, i + int2(1, 1), 0);
+    return lerp(lerp(a, b, f.x), lerp(c, d, f.x), f.y);
 }
 
-float mean(const std::vector<float>& vals)
+// There are no mipmaps, so bias and lod are ignored.
+float4 texture(ShaderViewerChannel channel, float2 uv, float bias)
 {
-    if (vals.size() == 0)
-        return 0.0f;
-
-    float s = 0;
-    for (float v: vals)
-        s += v;
-    return s / vals.size();
+    return texture(channel, uv);
 }
 
-float min(const std::vector<float>& vals)
+float4 textureLod(ShaderViewerChannel channel, float2 uv, float lod)
 {
-    if (vals.size() == 0)
-        return 0.0f;
-
-    float s = vals[0];
-    for (float v: vals)
-        s = v < s ? v : s;
-    return s;
+    return texture(channel, uv);
 }
 
-float max(const std::vector<float>& vals)
+int2 textureSize(ShaderViewerChannel channel, int lod)
 {
-    if (vals.size() == 0)
-        return 0.0f;
-
-    float s = vals[0];
-    for (float v: vals)
-        s = v > s ? v : s;
-    return s;
+    return int2(shaderViewerConstants.res.xy);
 }
+)";
 
-float median(const std::vector<float>& vals)
-{
-    if (vals.size() == 0)
-        return 0.0f;
+    source += shaderSource;
 
-    // The brainlet algorithm.
-    std::vector<float> v = vals;
-    std::sort(v.begin(), v.end());
-    return v[v.size()/2];
-}
+    source += shaderOptions.bufferPass ? R"(
+RWStructuredBuffer<float4> pixelData;
+)" : R"(
+RWStructuredBuffer<uint32_t> pixelData;
+)";
 
-float geomean(const std::vector<float>& vals)
+    source += "[numthreads(" +
+        std::to_string(shaderOptions.tileWidth) + ", " +
+        std::to_string(shaderOptions.tileHeight) + ", 1)]";
+
+    source += R"(
+void renderRunner(
+    uint3 dispatchThreadID : SV_DispatchThreadID,
+    uint3 groupThreadID : SV_GroupThreadID)
 {
-    if (vals.size() == 0)
-        return 0.0f;
+    // The resolution needn't be a multiple of the tile size.
+    if (any(dispatchThreadID.xy >= uint2(shaderViewerConstants.res.xy)))
+        return;
 
-    float s = 1.0;
-    for (float v: vals)
-        s *= v;
-    return pow(s, 1.0 / vals.size());
+    float4 color = float4(1);
+    float2 p = float2(dispatchThreadID.xy) + float2(0.5);
+    p.y = shaderViewerConstants.res.y - p.y;
+    mainImage(color, p);
+)";
+
+    if (shaderOptions.bufferPass)
+        source += "    pixelData[shaderViewerTexelIndex(int2(p))] = color;\n}\n";
+    else
+    {
+        // The pitch of tiled framebuffers is a multiple of 8.
+        if (shaderOptions.tiledFramebuffer)
+        {
+            source += R"(
+    uint2 tile = dispatchThreadID.xy / 8;
+    uint2 texel = dispatchThreadID.xy % 8;
+    uint i = (tile.x + tile.y * (shaderViewerConstants.pitch / 8)) * 64 + texel.x + texel.y * 8;
+)";
+        }
+        else
+            source += "    uint i = dispatchThreadID.x + dispatchThreadID.y * shaderViewerConstants.pitch;\n";
+        source += "    uint4 ucolor = uint4(saturate(color) * 255);\n";
+        source += "    pixelData[i] = "
+            "(ucolor.r << " + std::to_string(packing.rShift) + ") | "
+            "(ucolor.g << " + std::to_string(packing.gShift) + ") | "
+            "(ucolor.b << " + std::to_string(packing.bShift) + ") | "
+            "(ucolor.a << " + std::to_string(packing.aShift) + ");\n}\n";
+    }
+
+    //printf("%s\n", source.c_str());
+
+    std::vector<slang::CompilerOptionEntry> options = {
+        {slang::CompilerOptionName::AllowGLSL, {{}, allowGLSL ? 1 : 0}},
+        {slang::CompilerOptionName::EmitCPUMethod, {{}, shaderOptions.emitCPU}},
+        {slang::CompilerOptionName::Optimization, {{}, shaderOptions.optimization}},
+        {slang::CompilerOptionName::FloatingPointMode, {{}, shaderOptions.floatingPointMode}},
+        {slang::CompilerOptionName::DenormalModeFp16, {{}, shaderOptions.denormalMode}},
+        {slang::CompilerOptionName::DenormalModeFp32, {{}, shaderOptions.denormalMode}},
+        {slang::CompilerOptionName::DenormalModeFp64, {{}, shaderOptions.denormalMode}},
+        //{slang::CompilerOptionName::DumpIr, {{}, 1}}
+    };
+    std::string downstreamArgs = getDownstreamArgs(shaderOptions);
+    if (!downstreamArgs.empty())
+    {
+        options.push_back({
+            slang::CompilerOptionName::DownstreamArgs,
+            {{}, 0, 0, "llvm", downstreamArgs.c_str()}});
+    }
+
+    std::string cachePath;
+    if (!compiler.cacheDir.empty())
+    {
+        cachePath = getShaderCachePath(compiler, shaderOptions, source, options.data(), options.size());
+        if (loadCachedShader(cachePath, out))
+        {
+            std::string elf;
+            if (tryReadTextFile(cachePath.c_str(), elf))
+                out.codeSize = getElfSymbolSize(elf, "renderRunner_Group");
+            out.fromCache = true;
+            return true;
+        }
+    }
+
+    slang::TargetDesc target = {};
+    target.format = cachePath.empty() ? SLANG_SHADER_HOST_CALLABLE : SLANG_SHADER_SHARED_LIBRARY;
+    target.compilerOptionEntries = options.data();
+    target.compilerOptionEntryCount = options.size();
+
+    uint64_t sessionKey = hashCompilerOptions(HASH_SEED, options.data(), options.size());
+    sessionKey = hashBytes(sessionKey, &target.format, sizeof(target.format));
+    ShaderSession& ss = compiler.sessions[sessionKey];
+    if (ss.moduleCounter >= MAX_SESSION_MODULES)
+        ss = ShaderSession();
+    if (!ss.session)
+    {
+        // Not part of session-time, it's only ever created once.
+        slang::IGlobalSession* globalSession = getGlobalSession(compiler);
+        uint64_t sessionStartTicks = SDL_GetTicksNS();
+
+        slang::SessionDesc sessionDesc;
+        sessionDesc.targets = &target;
+        sessionDesc.targetCount = 1;
+        sessionDesc.allowGLSLSyntax = allowGLSL;
+        sessionDesc.compilerOptionEntries = options.data();
+        sessionDesc.compilerOptionEntryCount = options.size();
+
+        if (globalSession->createSession(sessionDesc, ss.session.writeRef()))
+        {
+            compiler.sessions.erase(sessionKey);
+            fprintf(stderr, "Failed to open session!\n");
+            return false;
+        }
+
+        if (allowGLSL)
+            ss.glslModule = ss.session->loadModule("glsl");
+
+        out.sessionTime = (SDL_GetTicksNS() - sessionStartTicks) * 1e-9;
+    }
+
+    std::string moduleName = "runner" + std::to_string(ss.moduleCounter++);
+    std::string modulePath = moduleName + ".slang";
+
+    Slang::ComPtr<slang::IBlob> diagnosticBlob;
+    slang::IModule* module = ss.session->loadModuleFromSourceString(
+        moduleName.c_str(), modulePath.c_str(), source.c_str(), diagnosticBlob.writeRef());
+    if (diagnosticBlob)
+        fprintf(stderr, "%s\n", (const char*)diagnosticBlob->getBufferPointer());
+    if (!module)
+    {
+        return false;
+    }
+
+    Slang::ComPtr<slang::IEntryPoint> entryPoint;
+    module->findEntryPointByName("renderRunner", entryPoint.writeRef());
+    
+    slang::IComponentType* components[] = {module, entryPoint, ss.glslModule};
+    Slang::ComPtr<slang::IComponentType> program;
+    SlangResult err = ss.session->createCompositeComponentType(
+        components,
+        allowGLSL ? 3 : 2,
+        program.writeRef(),
+        diagnosticBlob.writeRef());
+    if (diagnosticBlob)
+        fprintf(stderr, "%s\n", (const char*)diagnosticBlob->getBufferPointer());
+    if (err != SLANG_OK)
+    {
+        return false;
+    }
+
+    // LLVM prints remarks through its own diagnostic handler, which may end up
+    // in Slang's diagnostics or straight on stderr.
+    StderrCapture capture;
+    if (shaderOptions.captureRemarks)
+        startStderrCapture(capture);
+    auto finishRemarks = [&]() {
+        if (!shaderOptions.captureRemarks)
+            return;
+        out.remarks = finishStderrCapture(capture);
+        if (diagnosticBlob)
+            out.remarks += (const char*)diagnosticBlob->getBufferPointer();
+    };
+
+    if (!cachePath.empty())
+    {
+        Slang::ComPtr<slang::IBlob> code;
+        SlangResult codeResult = program->getEntryPointCode(0, 0, code.writeRef(), diagnosticBlob.writeRef());
+        finishRemarks();
+        if (codeResult != SLANG_OK)
+        {
+            if (diagnosticBlob)
+                fprintf(stderr, "%s\n", (const char*)diagnosticBlob->getBufferPointer());
+            fprintf(stderr, "Can't build shared libraries, disabling shader cache.\n");
+            compiler.cacheDir.clear();
+            return compileShader(compiler, shaderSource, allowGLSL, shaderOptions, out);
+        }
+
+        // Write to a temporary file first, so that nobody can load a partially
+        // written library. Other threads may be writing the same one.
+        std::string tmpPath = cachePath + "." +
+            std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        writeBinaryFile(tmpPath.c_str(), code->getBufferPointer(), code->getBufferSize());
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, cachePath, ec);
+        if (ec)
+            panic("Unable to write %s\n", cachePath.c_str());
+
+        if (!loadCachedShader(cachePath, out))
+        {
+            fprintf(stderr, "Failed to load %s: %s\n", cachePath.c_str(), SDL_GetError());
+            return false;
+        }
+        out.codeSize = getElfSymbolSize(
+            std::string((const char*)code->getBufferPointer(), code->getBufferSize()),
+            "renderRunner_Group");
+        return true;
+    }
+
+    SlangResult callableResult = program->getEntryPointHostCallable(
+        0,
+        0,
+        out.sharedLibrary.writeRef(),
+        diagnosticBlob.writeRef());
+    finishRemarks();
+    if (callableResult != SLANG_OK)
+    {
+        fprintf(stderr, "%s\n", (const char*)diagnosticBlob->getBufferPointer());
+        return false;
+    }
+
+    out.entryPointFunc =
+        (computeGroupEntryPoint)out.sharedLibrary->findFuncByName("renderRunner_Group");
+    if (!out.entryPointFunc)
+    {
+        fprintf(stderr, "Failed to find entry point!\n");
+        return false;
+    }
+    return true;
+}
+
+bool isPathToPasses(const char* path)
+{
+    return std::filesystem::path(path).extension().string() == ".passes";
+}
+
+// A .passes file lists the passes of a ShaderToy style multi-pass shader, one
+// per line:
+//
+//     <a|b|c|d|image> <shader> [iChannel<0-3>=<a|b|c|d>]...
+//
+// Shader paths are relative to the .passes file, lines starting with # are
+// comments. Only the Image pass is required.
+bool compileMultipassShader(
+    ShaderCompiler& compiler,
+    const char* path,
+    const ShaderOptions& shaderOptions,
+    CompiledShader& image,
+    std::unique_ptr<MultipassShader>& out
+){
+    struct PassDesc
+    {
+        bool present = false;
+        std::string path;
+        int channels[MAX_CHANNELS] = {-1, -1, -1, -1};
+    };
+    // Buffers A-D and the Image pass last.
+    PassDesc passes[MAX_BUFFER_PASSES + 1];
+
+    std::string manifest;
+    if (!tryReadTextFile(path, manifest))
+    {
+        fprintf(stderr, "Unable to read %s\n", path);
+        return false;
+    }
+    std::istringstream input(manifest);
+    int lineNumber = 0;
+    for (std::string line; std::getline(input, line);)
+    {
+        lineNumber++;
+        std::istringstream words(line);
+        std::string name, file;
+        if (!(words >> name) || name[0] == '#')
+            continue;
+
+        int index = -1;
+        if (name == "image")
+            index = MAX_BUFFER_PASSES;
+        else if (name.size() == 1 && name[0] >= 'a' && name[0] < 'a' + MAX_BUFFER_PASSES)
+            index = name[0] - 'a';
+        if (index < 0 || !(words >> file))
+        {
+            fprintf(stderr, "%s:%d: expected <a|b|c|d|image> <shader>\n", path, lineNumber);
+            return false;
+        }
+
+        PassDesc& pass = passes[index];
+        pass.present = true;
+        pass.path = (std::filesystem::path(path).parent_path() / file).string();
+        for (std::string binding; words >> binding;)
+        {
+            int channel = -1;
+            char buffer = 0;
+            if (binding.size() != strlen("iChannel0=a") ||
+                sscanf(binding.c_str(), "iChannel%d=%c", &channel, &buffer) != 2 ||
+                channel < 0 || channel >= MAX_CHANNELS ||
+                buffer < 'a' || buffer >= 'a' + MAX_BUFFER_PASSES)
+            {
+                fprintf(stderr, "%s:%d: bad channel binding %s\n", path, lineNumber, binding.c_str());
+                return false;
+            }
+            pass.channels[channel] = buffer - 'a';
+        }
+    }
+
+    if (!passes[MAX_BUFFER_PASSES].present)
+    {
+        fprintf(stderr, "%s: no image pass\n", path);
+        return false;
+    }
+
+    // Buffers that aren't there don't get a slot.
+    int bufferIndex[MAX_BUFFER_PASSES];
+    int bufferCount = 0;
+    for (int i = 0; i < MAX_BUFFER_PASSES; ++i)
+        bufferIndex[i] = passes[i].present ? bufferCount++ : -1;
+
+    for (PassDesc& pass: passes)
+    {
+        for (int& channel: pass.channels)
+        {
+            if (channel >= 0 && bufferIndex[channel] < 0)
+            {
+                fprintf(stderr, "%s: %s reads buffer %c, which isn't listed\n", path, pass.path.c_str(), 'a' + channel);
+                return false;
+            }
+            channel = channel >= 0 ? bufferIndex[channel] : -1;
+        }
+    }
+
+    std::unique_ptr<MultipassShader> mp(new MultipassShader);
+    mp->buffers.resize(bufferCount);
+    std::copy(
+        passes[MAX_BUFFER_PASSES].channels,
+        passes[MAX_BUFFER_PASSES].channels + MAX_CHANNELS,
+        mp->imageChannels);
+
+    ShaderOptions bufferOptions = shaderOptions;
+    bufferOptions.bufferPass = true;
+    bool fromCache = true;
+    float sessionTime = 0.0f;
+    for (int i = 0; i < MAX_BUFFER_PASSES; ++i)
+    {
+        if (bufferIndex[i] < 0)
+            continue;
+        BufferPass& buffer = mp->buffers[bufferIndex[i]];
+        std::copy(passes[i].channels, passes[i].channels + MAX_CHANNELS, buffer.channels);
+        const char* passPath = passes[i].path.c_str();
+        std::string passSource;
+        if (!tryReadTextFile(passPath, passSource))
+        {
+            fprintf(stderr, "Unable to read %s\n", passPath);
+            return false;
+        }
+        if (!compileShader(compiler, passSource.c_str(), isPathToGLSL(passPath), bufferOptions, buffer.shader))
+            return false;
+        fromCache = fromCache && buffer.shader.fromCache;
+        sessionTime += buffer.shader.sessionTime;
+    }
+
+    const char* imagePath = passes[MAX_BUFFER_PASSES].path.c_str();
+    std::string imageSource;
+    if (!tryReadTextFile(imagePath, imageSource))
+    {
+        fprintf(stderr, "Unable to read %s\n", imagePath);
+        return false;
+    }
+    if (!compileShader(compiler, imageSource.c_str(), isPathToGLSL(imagePath), shaderOptions, image))
+        return false;
+    image.fromCache = fromCache && image.fromCache;
+    image.sessionTime += sessionTime;
+    // Buffers can feed back into themselves, so any frame may look different.
+    if (bufferCount > 0)
+        image.inputs = SHADER_INPUT_ALL;
+
+    // A pass comes after the earlier buffers that it reads, everything else
+    // it reads is from the previous frame and already done.
+    std::vector<int> levels(bufferCount, 0);
+    for (int i = 0; i < bufferCount; ++i)
+    {
+        for (int channel: mp->buffers[i].channels)
+            if (channel >= 0 && channel < i)
+                levels[i] = std::max(levels[i], levels[channel] + 1);
+        if (levels[i] >= (int)mp->levels.size())
+            mp->levels.resize(levels[i] + 1);
+        mp->levels[levels[i]].push_back(i);
+    }
+
+    out = std::move(mp);
+    return true;
+}
+
+// Either a single shader or a .passes file. multipass is null for the former.
+bool compileShaderFile(
+    ShaderCompiler& compiler,
+    const char* path,
+    const ShaderOptions& shaderOptions,
+    CompiledShader& out,
+    std::unique_ptr<MultipassShader>& multipass
+){
+    multipass.reset();
+    if (isPathToPasses(path))
+        return compileMultipassShader(compiler, path, shaderOptions, out, multipass);
+    std::string shaderSource;
+    if (!tryReadTextFile(path, shaderSource))
+    {
+        fprintf(stderr, "Unable to read %s\n", path);
+        return false;
+    }
+    return compileShader(compiler, shaderSource.c_str(), isPathToGLSL(path), shaderOptions, out);
+}
+
+// Unbound channels read as zero, renderBufferPasses() binds them for each
+// frame.
+void setMultipass(ViewerResources& res, std::unique_ptr<MultipassShader> multipass)
+{
+    res.multipass = std::move(multipass);
+    for (RunnerChannel& channel: res.globalParams.channels)
+        channel = RunnerChannel();
+}
+
+bool loadShaderFromSource(ViewerResources& res, const char* shaderSource, bool allowGLSL)
+{
+    CompiledShader shader;
+    bool status = compileShader(res.compiler, shaderSource, allowGLSL, res.shaderOptions, shader);
+    res.shader = std::move(shader);
+    setMultipass(res, nullptr);
+    return status;
+}
+
+bool loadShaderFile(ViewerResources& res, const char* path)
+{
+    CompiledShader shader;
+    std::unique_ptr<MultipassShader> multipass;
+    bool status = compileShaderFile(res.compiler, path, res.shaderOptions, shader, multipass);
+    res.shader = std::move(shader);
+    setMultipass(res, std::move(multipass));
+    return status;
+}
+
+bool loadShader(ViewerResources& res, const char* path)
+{
+    bool status = path ? loadShaderFile(res, path) : false;
+    if (!status)
+    {
+        const char* fallbackSource = R"(
+void mainImage(out vec4 fragColor, in vec2 fragCoord)
+{
+    fragColor = vec4(1.0,0.0,0.0,1.0);
+}
+)";
+        loadShaderFromSource(res, fallbackSource, true);
+    }
+    return status;
+}
+
+void renderTile(ViewerResources& res, int xTile, int yTile)
+{
+    if (res.shader.entryPointFunc)
+    {
+        int gid[3] = {xTile, yTile, 0};
+        res.shader.entryPointFunc(gid, nullptr, &res.globalParams);
+    }
+}
+
+// Writes the pixels of a tile without running the shader. Done once over a
+// fresh framebuffer with the same scheduler as rendering, so that its pages
+// get allocated on the NUMA node of the thread that's likely to render them.
+void firstTouchTile(ViewerResources& res, int xTile, int yTile)
+{
+    const ShaderViewerConstants& params = *res.globalParams.constants;
+    int x0 = xTile * res.shader.tileWidth;
+    int y0 = yTile * res.shader.tileHeight;
+    int x1 = std::min(x0 + res.shader.tileWidth, int(params.resX));
+    int y1 = std::min(y0 + res.shader.tileHeight, int(params.resY));
+    for (int y = y0; y < y1; ++y)
+    for (int x = x0; x < x1; ++x)
+    {
+        size_t i = res.shader.tiledFramebuffer ?
+            getTiledPixelIndex(x, y, params.pitch) : x + y * params.pitch;
+        res.globalParams.pixelData[i] = 0;
+    }
+}
+
+#ifdef __linux__
+// Whatever the process was started with, e.g. by taskset. Saved by main()
+// before any thread is pinned.
+cpu_set_t processAffinity;
+#endif
+
+void saveProcessAffinity()
+{
+#ifdef __linux__
+    if (sched_getaffinity(0, sizeof(processAffinity), &processAffinity) != 0)
+    {
+        CPU_ZERO(&processAffinity);
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+            CPU_SET(i, &processAffinity);
+    }
+#endif
+}
+
+// Pins to the given CPU, or back to the process affinity with -1. Threads
+// that don't render call this with -1 first, since they inherit the mask of
+// the main thread, which is pinned as OpenMP thread 0.
+void pinCurrentThread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu < 0)
+        set = processAffinity;
+    else CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 && cpu >= 0)
+        fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
+#else
+    if (cpu >= 0)
+        fprintf(stderr, "Thread pinning is not supported on this platform\n");
+#endif
+}
+
+int getPinnedCpu(ViewerResources& res, int threadIndex)
+{
+    if (res.pinnedCpus.empty())
+        return -1;
+    return res.pinnedCpus[threadIndex % res.pinnedCpus.size()];
+}
+
+int getThreadCount(ViewerResources& res)
+{
+    if (res.threadCount > 0)
+        return res.threadCount;
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+uint32_t mortonCode(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint32_t v)
+    {
+        v &= 0xFFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+bool popChunk(StealingThreadPool::Worker& worker, uint32_t& chunk)
+{
+    uint64_t range = worker.range.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t begin = range, end = range >> 32;
+        if (begin >= end)
+            return false;
+        uint64_t next = (uint64_t(end) << 32) | (begin + 1);
+        if (worker.range.compare_exchange_weak(range, next, std::memory_order_acquire))
+        {
+            chunk = begin;
+            return true;
+        }
+    }
+}
+
+bool stealChunk(StealingThreadPool& pool, int thief, uint32_t& chunk)
+{
+    for (int i = 1; i < pool.workerCount; ++i)
+    {
+        StealingThreadPool::Worker& victim = pool.workers[(thief + i) % pool.workerCount];
+        uint64_t range = victim.range.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            uint32_t begin = range, end = range >> 32;
+            if (begin >= end)
+                break;
+
+            // Take the far half, the victim keeps the chunks nearest to
+            // where it's currently rendering.
+            uint32_t mid = begin + (end - begin) / 2;
+            uint64_t next = (uint64_t(mid) << 32) | begin;
+            if (victim.range.compare_exchange_weak(range, next, std::memory_order_acquire))
+            {
+                // Nobody can steal from an empty range, so a plain store is
+                // fine here.
+                chunk = mid;
+                pool.workers[thief].range.store(
+                    (uint64_t(end) << 32) | (mid + 1), std::memory_order_release);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void runStealingWorker(StealingThreadPool& pool, int index)
+{
+    uint32_t chunk;
+    while (popChunk(pool.workers[index], chunk) || stealChunk(pool, index, chunk))
+    {
+        size_t begin = size_t(chunk) * pool.chunkSize;
+        size_t end = std::min(begin + pool.chunkSize, pool.tileOrder.size());
+        for (size_t i = begin; i < end; ++i)
+        {
+            uint32_t tile = pool.tileOrder[i];
+            pool.tileFunc(*pool.res, tile & 0xFFFF, tile >> 16);
+        }
+    }
+}
+
+int getCurrentThreadId()
+{
+#ifdef __linux__
+    return syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+void stealingThread(StealingThreadPool& pool, int index, int cpu)
+{
+    if (cpu >= 0)
+        pinCurrentThread(cpu);
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.threadIds[index-1] = getCurrentThreadId();
+        pool.startedThreads++;
+    }
+    pool.doneCv.notify_one();
+
+    uint64_t seenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.startCv.wait(lock, [&]{ return pool.quit || pool.generation != seenGeneration; });
+            if (pool.quit)
+                return;
+            seenGeneration = pool.generation;
+        }
+
+        runStealingWorker(pool, index);
+
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (--pool.busyThreads == 0)
+            pool.doneCv.notify_one();
+    }
+}
+
+void startStealingThreadPool(ViewerResources& res, int threadCount)
+{
+    stopStealingThreadPool(res);
+
+    res.stealPool.reset(new StealingThreadPool);
+    StealingThreadPool& pool = *res.stealPool;
+    pool.res = &res;
+    pool.workerCount = std::max(threadCount, 1);
+    pool.workers.reset(new StealingThreadPool::Worker[pool.workerCount]);
+    for (int i = 0; i < pool.workerCount; ++i)
+        pool.workers[i].range = 0;
+    pool.threadIds.resize(pool.workerCount - 1);
+    for (int i = 1; i < pool.workerCount; ++i)
+        pool.threads.emplace_back(stealingThread, std::ref(pool), i, getPinnedCpu(res, i));
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.doneCv.wait(lock, [&]{ return pool.startedThreads == pool.threads.size(); });
+}
+
+void stopStealingThreadPool(ViewerResources& res)
+{
+    if (!res.stealPool)
+        return;
+
+    StealingThreadPool& pool = *res.stealPool;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.quit = true;
+    }
+    pool.startCv.notify_all();
+    for (std::thread& t: pool.threads)
+        t.join();
+    res.stealPool.reset();
+}
+
+// How many tiles of the subset fit along an axis of `size` pixels.
+int getSubsetTileCount(int size, int tileSize, int step, int offset)
+{
+    int tiles = (size + tileSize - 1) / tileSize;
+    return std::max(tiles - offset + step - 1, 0) / step;
+}
+
+void renderFrameStealing(ViewerResources& res, int width, int height, TileFunc func)
+{
+    if (!res.stealPool)
+        startStealingThreadPool(res, getThreadCount(res));
+    StealingThreadPool& pool = *res.stealPool;
+    pool.tileFunc = func;
+
+    int xTiles = (width + res.shader.tileWidth - 1) / res.shader.tileWidth;
+    int yTiles = (height + res.shader.tileHeight - 1) / res.shader.tileHeight;
+    const TileSubset& subset = res.tileSubset;
+
+    if (pool.orderXTiles != xTiles || pool.orderYTiles != yTiles || pool.orderSubset != subset)
+    {
+        pool.orderXTiles = xTiles;
+        pool.orderYTiles = yTiles;
+        pool.orderSubset = subset;
+        pool.tileOrder.clear();
+        for (int y = subset.offsetY; y < yTiles; y += subset.step)
+        for (int x = subset.offsetX; x < xTiles; x += subset.step)
+            pool.tileOrder.push_back(x | (y << 16));
+        std::sort(
+            pool.tileOrder.begin(), pool.tileOrder.end(),
+            [](uint32_t a, uint32_t b) {
+                return mortonCode(a & 0xFFFF, a >> 16) < mortonCode(b & 0xFFFF, b >> 16);
+            });
+
+        // Small enough chunks that stealing can still balance out uneven
+        // tiles, large enough to not hammer the ranges with CAS.
+        pool.chunkSize = std::clamp(int(pool.tileOrder.size()) / (pool.workerCount * 32), 1, 16);
+    }
+
+    uint32_t chunkCount = (pool.tileOrder.size() + pool.chunkSize - 1) / pool.chunkSize;
+    for (int i = 0; i < pool.workerCount; ++i)
+    {
+        uint64_t begin = uint64_t(chunkCount) * i / pool.workerCount;
+        uint64_t end = uint64_t(chunkCount) * (i + 1) / pool.workerCount;
+        pool.workers[i].range.store((end << 32) | begin, std::memory_order_relaxed);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.generation++;
+        pool.busyThreads = pool.threads.size();
+    }
+    pool.startCv.notify_all();
+
+    runStealingWorker(pool, 0);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.doneCv.wait(lock, [&]{ return pool.busyThreads == 0; });
+}
+
+void renderFrameMultithread(ViewerResources& res, int width, int height, TileFunc func = renderTile)
+{
+    if (res.scheduler == TileScheduler::STEAL)
+    {
+        renderFrameStealing(res, width, height, func);
+        return;
+    }
+
+    const TileSubset& subset = res.tileSubset;
+    int xTiles = getSubsetTileCount(width, res.shader.tileWidth, subset.step, subset.offsetX);
+    int yTiles = getSubsetTileCount(height, res.shader.tileHeight, subset.step, subset.offsetY);
+
+    #pragma omp parallel for collapse(2) schedule(dynamic,1) num_threads(getThreadCount(res))
+    for (int y = 0; y < yTiles; ++y)
+    for (int x = 0; x < xTiles; ++x)
+        func(res, subset.offsetX + x * subset.step, subset.offsetY + y * subset.step);
+}
+
+void renderFrameSinglethread(ViewerResources& res, int width, int height, TileFunc func = renderTile)
+{
+    const TileSubset& subset = res.tileSubset;
+    int xTiles = (width + res.shader.tileWidth - 1) / res.shader.tileWidth;
+    int yTiles = (height + res.shader.tileHeight - 1) / res.shader.tileHeight;
+
+    for (int y = subset.offsetY; y < yTiles; y += subset.step)
+    for (int x = subset.offsetX; x < xTiles; x += subset.step)
+        func(res, x, y);
+}
+
+// Renders several frames in one parallel region, each with its own constants.
+// The frames of a tile are rendered back to back by the same thread, so the
+// framebuffer ends up holding the last frame. Always OpenMP.
+void renderFrameBatch(ViewerResources& res, int width, int height, RunnerGlobalParams* frames, int frameCount, bool multithreaded)
+{
+    auto func = res.shader.entryPointFunc;
+    if (!func)
+        return;
+
+    const TileSubset& subset = res.tileSubset;
+    int xTiles = getSubsetTileCount(width, res.shader.tileWidth, subset.step, subset.offsetX);
+    int yTiles = getSubsetTileCount(height, res.shader.tileHeight, subset.step, subset.offsetY);
+
+    #pragma omp parallel for collapse(2) schedule(dynamic,1) num_threads(multithreaded ? getThreadCount(res) : 1)
+    for (int y = 0; y < yTiles; ++y)
+    for (int x = 0; x < xTiles; ++x)
+    {
+        int gid[3] = {subset.offsetX + x * subset.step, subset.offsetY + y * subset.step, 0};
+        for (int i = 0; i < frameCount; ++i)
+            func(gid, nullptr, &frames[i]);
+    }
+}
+
+// Renders the buffer passes of a multi-pass shader and binds their output for
+// the Image pass, which is rendered as usual afterwards. The constants must be
+// set up for the frame already. Always full resolution and OpenMP, tile
+// subsets and the stealing scheduler only apply to the Image pass.
+void renderBufferPasses(ViewerResources& res, int width, int height, bool multithreaded)
+{
+    MultipassShader& mp = *res.multipass;
+    size_t texelCount = getTiledTexelCount(width, height);
+    if (mp.width != width || mp.height != height)
+    {
+        for (BufferPass& pass: mp.buffers)
+        {
+            pass.data[0].assign(texelCount * 4, 0.0f);
+            pass.data[1].assign(texelCount * 4, 0.0f);
+            pass.current = 0;
+        }
+        mp.width = width;
+        mp.height = height;
+    }
+
+    // Last frame's output becomes the previous frame.
+    for (BufferPass& pass: mp.buffers)
+        pass.current = 1 - pass.current;
+
+    auto bindChannels = [&](const int* channels, int self, RunnerChannel* out) {
+        for (int c = 0; c < MAX_CHANNELS; ++c)
+        {
+            out[c] = RunnerChannel();
+            if (channels[c] < 0)
+                continue;
+            const BufferPass& src = mp.buffers[channels[c]];
+            int which = channels[c] < self ? src.current : 1 - src.current;
+            out[c] = {src.data[which].data(), texelCount};
+        }
+    };
+
+    for (size_t i = 0; i < mp.buffers.size(); ++i)
+    {
+        BufferPass& pass = mp.buffers[i];
+        pass.params.constants = res.constants.get();
+        bindChannels(pass.channels, i, pass.params.channels);
+        pass.params.pixelData = (uint32_t*)pass.data[pass.current].data();
+        pass.params.pixelDataSize = texelCount;
+    }
+    bindChannels(mp.imageChannels, mp.buffers.size(), res.globalParams.channels);
+
+    // Writes only go to data[current], which nobody reads this frame before
+    // its level is done, so a level is one flat list of tiles over its passes.
+    for (const std::vector<int>& level: mp.levels)
+    {
+        int tileStart[MAX_BUFFER_PASSES + 1] = {0};
+        int xTiles[MAX_BUFFER_PASSES];
+        for (size_t i = 0; i < level.size(); ++i)
+        {
+            const CompiledShader& shader = mp.buffers[level[i]].shader;
+            xTiles[i] = (width + shader.tileWidth - 1) / shader.tileWidth;
+            int yTiles = (height + shader.tileHeight - 1) / shader.tileHeight;
+            tileStart[i+1] = tileStart[i] + xTiles[i] * yTiles;
+        }
+
+        #pragma omp parallel for schedule(dynamic,1) num_threads(multithreaded ? getThreadCount(res) : 1)
+        for (int t = 0; t < tileStart[level.size()]; ++t)
+        {
+            size_t i = 0;
+            while (t >= tileStart[i+1])
+                i++;
+            BufferPass& pass = mp.buffers[level[i]];
+            int tile = t - tileStart[i];
+            int gid[3] = {tile % xTiles[i], tile / xTiles[i], 0};
+            pass.shader.entryPointFunc(gid, nullptr, &pass.params);
+        }
+    }
+}
+
+// Must be called after changing threadCount or pinnedCpus.
+void applyThreadConfig(ViewerResources& res)
+{
+    // Restarted with the new configuration on next use.
+    stopStealingThreadPool(res);
+
+#ifdef _OPENMP
+    // OpenMP keeps reusing the same threads as long as the team size doesn't
+    // change, so pinning them once is enough.
+    #pragma omp parallel num_threads(getThreadCount(res))
+    pinCurrentThread(getPinnedCpu(res, omp_get_thread_num()));
+#else
+    pinCurrentThread(getPinnedCpu(res, 0));
+#endif
+}
+
+void timedRenderTile(ViewerResources& res, int xTile, int yTile)
+{
+    uint64_t start = SDL_GetPerformanceCounter();
+    renderTile(res, xTile, yTile);
+    uint64_t end = SDL_GetPerformanceCounter();
+    res.tileTiming.ticks[xTile + yTile * res.tileTiming.xTiles].value += end - start;
+}
+
+TileFunc getTileFunc(ViewerResources& res)
+{
+    return res.tileTiming.enabled ? timedRenderTile : renderTile;
+}
+
+void resetTileTiming(ViewerResources& res, int width, int height)
+{
+    TileTiming& timing = res.tileTiming;
+    timing.tileWidth = res.shader.tileWidth;
+    timing.tileHeight = res.shader.tileHeight;
+    timing.xTiles = (width + timing.tileWidth - 1) / timing.tileWidth;
+    timing.yTiles = (height + timing.tileHeight - 1) / timing.tileHeight;
+    timing.frames = 0;
+    timing.ticks.assign(timing.xTiles * timing.yTiles, TileTiming::Ticks());
+}
+
+// Black, red, yellow, white.
+uint32_t heatmapColor(float t)
+{
+    t = std::clamp(t, 0.0f, 1.0f) * 3.0f;
+    uint32_t r = std::clamp(t, 0.0f, 1.0f) * 255;
+    uint32_t g = std::clamp(t - 1.0f, 0.0f, 1.0f) * 255;
+    uint32_t b = std::clamp(t - 2.0f, 0.0f, 1.0f) * 255;
+    return (255u << 24) | (b << 16) | (g << 8) | r;
+}
+
+// Tile times relative to the slowest tile, in row-major tile order.
+std::vector<float> getRelativeTileTimes(const TileTiming& timing)
+{
+    uint64_t maxTicks = 1;
+    for (TileTiming::Ticks t: timing.ticks)
+        maxTicks = std::max(maxTicks, t.value);
+
+    std::vector<float> relative(timing.ticks.size());
+    for (size_t i = 0; i < timing.ticks.size(); ++i)
+        relative[i] = double(timing.ticks[i].value) / maxTicks;
+    return relative;
+}
+
+// Blends the heatmap over a rendered frame with the given pixel format.
+void overlayTileHeatmap(const TileTiming& timing, uint32_t* pixels, int width, int height, int pitch, SDL_PixelFormat format)
+{
+    PixelPacking packing;
+    getPixelPacking(format, packing);
+
+    std::vector<float> relative = getRelativeTileTimes(timing);
+    for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+    {
+        int tile = x / timing.tileWidth + y / timing.tileHeight * timing.xTiles;
+        uint32_t abgr = heatmapColor(relative[tile]);
+        uint32_t heat = packPixel(packing, abgr & 0xFF, (abgr >> 8) & 0xFF, (abgr >> 16) & 0xFF, abgr >> 24);
+        uint32_t& p = pixels[x + y * pitch];
+        // Average of the two, channel by channel.
+        p = ((p >> 1) & 0x7F7F7F7F) + ((heat >> 1) & 0x7F7F7F7F);
+    }
+}
+
+// Writes a CSV if path ends in .csv and a BMP otherwise.
+void writeTileTiming(const TileTiming& timing, const char* path)
+{
+    if (timing.ticks.size() == 0)
+        panic("No tile timings recorded, enable them with tile-timing on\n");
+
+    if (std::filesystem::path(path).extension().string() == ".csv")
+    {
+        FILE* f = fopen(path, "wb");
+        if (!f) panic("Unable to open %s\n", path);
+
+        double frequency = SDL_GetPerformanceFrequency();
+        fprintf(f, "tile_x,tile_y,total_seconds,mean_seconds\n");
+        for (int y = 0; y < timing.yTiles; ++y)
+        for (int x = 0; x < timing.xTiles; ++x)
+        {
+            double total = timing.ticks[x + y * timing.xTiles].value / frequency;
+            fprintf(f, "%d,%d,%.9g,%.9g\n", x, y, total, total / std::max(timing.frames, 1));
+        }
+        fclose(f);
+        return;
+    }
+
+    int width = timing.xTiles * timing.tileWidth;
+    int height = timing.yTiles * timing.tileHeight;
+    std::vector<float> relative = getRelativeTileTimes(timing);
+    std::vector<uint32_t> pixels(width * height);
+    for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+        pixels[x + y * width] = heatmapColor(relative[x / timing.tileWidth + y / timing.tileHeight * timing.xTiles]);
+
+    SDL_Surface* surf = SDL_CreateSurfaceFrom(width, height, SDL_PIXELFORMAT_ABGR8888, pixels.data(), width * 4);
+    if (!surf || !SDL_SaveBMP(surf, path))
+        panic("Unable to write %s: %s\n", path, SDL_GetError());
+    SDL_DestroySurface(surf);
+}
+
+// OS thread IDs of the threads that render frames with the current settings.
+std::vector<int> getRenderThreadIds(ViewerResources& res, bool multithreaded)
+{
+    std::vector<int> ids = {getCurrentThreadId()};
+    if (!multithreaded)
+        return ids;
+
+    if (res.scheduler == TileScheduler::STEAL)
+    {
+        if (!res.stealPool)
+            startStealingThreadPool(res, getThreadCount(res));
+        ids.insert(ids.end(), res.stealPool->threadIds.begin(), res.stealPool->threadIds.end());
+        return ids;
+    }
+
+#ifdef _OPENMP
+    // Relies on OpenMP reusing the same threads for same-sized teams, like
+    // pinning does.
+    int threadCount = getThreadCount(res);
+    ids.resize(threadCount);
+    #pragma omp parallel num_threads(threadCount)
+    ids[omp_get_thread_num()] = getCurrentThreadId();
+#endif
+    return ids;
+}
+
+std::vector<PerfCounterDesc> getDefaultPerfCounters()
+{
+#ifdef __linux__
+    auto cacheMiss = [](uint64_t cache)
+    {
+        return cache |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    return {
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {"l1d-misses", PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_L1D)},
+        {"llc-misses", PERF_TYPE_HW_CACHE, cacheMiss(PERF_COUNT_HW_CACHE_LL)}
+    };
+#else
+    return {};
+#endif
+}
+
+void closePerfCounters(PerfCounters& counters)
+{
+#ifdef __linux__
+    for (int fd: counters.fds)
+        if (fd >= 0)
+            close(fd);
+#endif
+    counters.fds.clear();
+    counters.threadCount = 0;
+}
+
+void openPerfCounters(PerfCounters& counters, const std::vector<int>& threadIds)
+{
+    closePerfCounters(counters);
+#ifdef __linux__
+    counters.threadCount = threadIds.size();
+    for (int tid: threadIds)
+    {
+        for (const PerfCounterDesc& desc: counters.descs)
+        {
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = desc.type;
+            attr.config = desc.config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            // The kernel multiplexes counters if there are more than the
+            // hardware has, these are needed to scale the values back up.
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            int fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+            if (fd < 0 && tid == threadIds[0])
+                fprintf(stderr, "Can't open perf counter %s: %s\n", desc.name.c_str(), strerror(errno));
+            counters.fds.push_back(fd);
+        }
+    }
+#endif
+}
+
+// Sums of each counter over all render threads.
+void readPerfCounters(PerfCounters& counters, std::vector<double>& values)
+{
+    values.assign(counters.descs.size(), 0.0);
+#ifdef __linux__
+    for (int t = 0; t < counters.threadCount; ++t)
+    for (size_t i = 0; i < counters.descs.size(); ++i)
+    {
+        int fd = counters.fds[t * counters.descs.size() + i];
+        uint64_t data[3];
+        if (fd < 0 || read(fd, data, sizeof(data)) != sizeof(data) || data[2] == 0)
+            continue;
+        values[i] += double(data[0]) * data[1] / data[2];
+    }
+#endif
+}
+
+void printUsage(FILE* out, char* programName)
+{
+    fprintf(out,
+        "Usage: %s [--headless] [benchmark-command-list-file]\n"
+        "       %s --frame-stats <path>\n"
+        "       %s --coordinate <benchmark-command-list-file> <host>...\n"
+        "Check the README for how the benchmark command list works.\n"
+        "--headless renders benchmarks without opening a window.\n"
+        "--frame-stats writes interactive frame time histograms to <path> on exit, - for stdout.\n"
+        "--coordinate splits the runs of a benchmark between headless workers on the hosts\n"
+        "  (ssh, or 'local' for this machine) and prints and exports their combined results.\n",
+        programName, programName, programName);
+}
+
+// Log-linear histogram of microsecond durations, like HdrHistogram: exact
+// below 64us and then 32 buckets per power of two, so ~3% relative error
+// without allocating anything per sample. Also tracks the last WINDOW
+// samples so that percentiles follow what's on screen right now.
+struct LatencyHistogram
+{
+    static constexpr int LINEAR_BUCKETS = 64;
+    static constexpr int SUB_BUCKETS = 32;
+    static constexpr int OCTAVES = 24;
+    static constexpr int BUCKETS = LINEAR_BUCKETS + OCTAVES * SUB_BUCKETS;
+    static constexpr int WINDOW = 1024;
+
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total = 0;
+    double sumUs = 0.0;
+    uint64_t maxUs = 0;
+    uint64_t hitches = 0;
+
+    uint32_t windowCounts[BUCKETS] = {};
+    uint16_t window[WINDOW];
+    int windowPos = 0;
+    int windowFill = 0;
+};
+
+// 60 fps budget.
+constexpr uint64_t HITCH_THRESHOLD_US = 16667;
+
+int latencyBucket(uint64_t us)
+{
+    if (us < LatencyHistogram::LINEAR_BUCKETS)
+        return us;
+
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - 5;
+    int top = us >> shift;
+    int index = LatencyHistogram::LINEAR_BUCKETS + (shift - 1) * LatencyHistogram::SUB_BUCKETS + (top - LatencyHistogram::SUB_BUCKETS);
+    return std::min(index, LatencyHistogram::BUCKETS - 1);
+}
+
+// Lower and upper bound of the bucket, in microseconds.
+void latencyBucketRange(int index, double& low, double& high)
+{
+    if (index < LatencyHistogram::LINEAR_BUCKETS)
+    {
+        low = index;
+        high = index + 1;
+        return;
+    }
+    index -= LatencyHistogram::LINEAR_BUCKETS;
+    int shift = index / LatencyHistogram::SUB_BUCKETS + 1;
+    uint64_t top = index % LatencyHistogram::SUB_BUCKETS + LatencyHistogram::SUB_BUCKETS;
+    low = double(top << shift);
+    high = double((top + 1) << shift);
+}
+
+void recordLatency(LatencyHistogram& hist, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = latencyBucket(us);
+
+    hist.counts[bucket]++;
+    hist.total++;
+    hist.sumUs += us;
+    hist.maxUs = std::max(hist.maxUs, us);
+    if (us > HITCH_THRESHOLD_US)
+        hist.hitches++;
+
+    if (hist.windowFill == LatencyHistogram::WINDOW)
+        hist.windowCounts[hist.window[hist.windowPos]]--;
+    else
+        hist.windowFill++;
+    hist.window[hist.windowPos] = bucket;
+    hist.windowCounts[bucket]++;
+    hist.windowPos = (hist.windowPos + 1) % LatencyHistogram::WINDOW;
+}
+
+// In milliseconds, from the middle of the bucket containing the percentile.
+template<typename T>
+double latencyPercentile(const T* counts, uint64_t total, double p)
+{
+    if (total == 0)
+        return 0.0;
+
+    uint64_t rank = std::max(uint64_t(1), uint64_t(ceil(p / 100.0 * total)));
+    uint64_t seen = 0;
+    for (int i = 0; i < LatencyHistogram::BUCKETS; ++i)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            double low, high;
+            latencyBucketRange(i, low, high);
+            return (low + high) * 0.5e-3;
+        }
+    }
+    return 0.0;
+}
+
+struct FramePacingStats
+{
+    LatencyHistogram frame;
+    LatencyHistogram render;
+    LatencyHistogram present;
+};
+
+std::string summarizeLatency(const char* name, const LatencyHistogram& hist, bool recent)
+{
+    char buf[256];
+    if (recent)
+    {
+        snprintf(buf, sizeof(buf), "%s p50 %.2f p95 %.2f p99 %.2f ms", name,
+            latencyPercentile(hist.windowCounts, hist.windowFill, 50),
+            latencyPercentile(hist.windowCounts, hist.windowFill, 95),
+            latencyPercentile(hist.windowCounts, hist.windowFill, 99));
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%s: %llu samples, mean %.3f, p50 %.3f, p95 %.3f, p99 %.3f, p99.9 %.3f, max %.3f ms, %llu over %.1f ms",
+            name, (unsigned long long)hist.total,
+            hist.total == 0 ? 0.0 : hist.sumUs / hist.total * 1e-3,
+            latencyPercentile(hist.counts, hist.total, 50),
+            latencyPercentile(hist.counts, hist.total, 95),
+            latencyPercentile(hist.counts, hist.total, 99),
+            latencyPercentile(hist.counts, hist.total, 99.9),
+            hist.maxUs * 1e-3,
+            (unsigned long long)hist.hitches, HITCH_THRESHOLD_US * 1e-3);
+    }
+    return buf;
+}
+
+void dumpFramePacingStats(const FramePacingStats& stats, const char* path)
+{
+    FILE* f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s for writing frame stats\n", path);
+        return;
+    }
+
+    const std::pair<const char*, const LatencyHistogram*> hists[] = {
+        {"frame", &stats.frame},
+        {"render", &stats.render},
+        {"present", &stats.present}
+    };
+    for (auto [name, hist]: hists)
+        fprintf(f, "%s\n", summarizeLatency(name, *hist, false).c_str());
+
+    // Nonzero buckets, for plotting the full distribution.
+    fprintf(f, "\nhistogram,bucket-low-ms,bucket-high-ms,count\n");
+    for (auto [name, hist]: hists)
+    for (int i = 0; i < LatencyHistogram::BUCKETS; ++i)
+    {
+        if (hist->counts[i] == 0)
+            continue;
+        double low, high;
+        latencyBucketRange(i, low, high);
+        fprintf(f, "%s,%.3f,%.3f,%llu\n", name, low * 1e-3, high * 1e-3, (unsigned long long)hist->counts[i]);
+    }
+
+    if (f != stdout)
+        fclose(f);
+}
+
+// Builds shaders for the interactive viewer on a separate thread, so that the
+// render loop can keep drawing with the old shader in the meantime.
+struct ShaderBuilder
+{
+    struct Request
+    {
+        std::string path;
+        SDL_Time modifyTime;
+    };
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool quit = false;
+
+    // Newer requests replace older ones that haven't started building yet.
+    bool hasRequest = false;
+    Request request;
+
+    bool hasResult = false;
+    bool resultOk = false;
+    Request resultRequest;
+    CompiledShader result;
+    std::unique_ptr<MultipassShader> resultMultipass;
+};
+
+void shaderBuilderThread(ViewerResources& res, ShaderBuilder& builder)
+{
+    pinCurrentThread(-1);
+    std::unique_lock<std::mutex> lock(builder.mutex);
+    for (;;)
+    {
+        builder.cv.wait(lock, [&]{ return builder.quit || builder.hasRequest; });
+        if (builder.quit)
+            break;
+
+        ShaderBuilder::Request request = builder.request;
+        builder.hasRequest = false;
+        lock.unlock();
+
+        CompiledShader shader;
+        std::unique_ptr<MultipassShader> multipass;
+        bool ok = compileShaderFile(
+            res.compiler, request.path.c_str(), res.shaderOptions, shader, multipass);
+
+        lock.lock();
+        builder.hasResult = true;
+        builder.resultOk = ok;
+        builder.resultRequest = request;
+        builder.result = std::move(shader);
+        builder.resultMultipass = std::move(multipass);
+    }
+}
+
+void startShaderBuilder(ViewerResources& res, ShaderBuilder& builder)
+{
+    builder.thread = std::thread(shaderBuilderThread, std::ref(res), std::ref(builder));
+}
+
+void stopShaderBuilder(ShaderBuilder& builder)
+{
+    {
+        std::lock_guard<std::mutex> lock(builder.mutex);
+        builder.quit = true;
+    }
+    builder.cv.notify_one();
+    builder.thread.join();
+}
+
+void requestShaderBuild(ShaderBuilder& builder, const std::string& path, SDL_Time modifyTime)
+{
+    {
+        std::lock_guard<std::mutex> lock(builder.mutex);
+        builder.hasRequest = true;
+        builder.request = {path, modifyTime};
+    }
+    builder.cv.notify_one();
+}
+
+// Interactive mode can render at a fraction of the window resolution and
+// upscale when presenting, optionally picking the fraction automatically to
+// hit a target frame time.
+struct RenderScale
+{
+    float scale = 1.0f;
+    bool adaptive = false;
+    bool linear = true;
+    double targetFrameTime = HITCH_THRESHOLD_US * 1e-6;
+    // Exponential moving average, 0 when there's no history.
+    double averageFrameTime = 0.0;
+};
+
+static constexpr float MIN_RENDER_SCALE = 0.125f;
+
+void updateRenderScale(RenderScale& rs, double frameTime)
+{
+    if (!rs.adaptive)
+        return;
+
+    rs.averageFrameTime = rs.averageFrameTime == 0.0 ? frameTime :
+        rs.averageFrameTime * 0.9 + frameTime * 0.1;
+
+    // Leave some slack so that the scale doesn't jitter around the target.
+    double ratio = rs.targetFrameTime / rs.averageFrameTime;
+    if (ratio > 0.9 && ratio < 1.1)
+        return;
+
+    // Render time goes roughly with the pixel count, so the square of the
+    // scale.
+    float oldScale = rs.scale;
+    float step = std::clamp(sqrt(ratio), 0.5, 2.0);
+    rs.scale = std::clamp(rs.scale * step, MIN_RENDER_SCALE, 1.0f);
+
+    // Predict the new average instead of waiting for it to converge, or the
+    // scale would overshoot.
+    float change = rs.scale / oldScale;
+    rs.averageFrameTime *= change * change;
+}
+
+// Stretches a frame of a different size than the window onto it.
+void presentScaledFramebuffer(ViewerResources& res, uint32_t* pixels, int width, int height, bool linear)
+{
+    SDL_Surface* src = SDL_CreateSurfaceFrom(width, height, res.shader.pixelFormat, pixels, width * 4);
+    if (!src)
+        return;
+    SDL_BlitSurfaceScaled(src, nullptr, res.surf, nullptr, linear ? SDL_SCALEMODE_LINEAR : SDL_SCALEMODE_NEAREST);
+    SDL_DestroySurface(src);
+    SDL_UpdateWindowSurface(res.window);
+}
+
+// Splits the tiles into interlace x interlace phases and renders one phase
+// per frame, so that slow shaders still show something new every frame. The
+// interlace factor grows while a phase doesn't fit in the budget.
+struct ProgressiveRefinement
+{
+    bool enabled = false;
+    // Always a power of two, 1 renders everything every frame.
+    int interlace = 1;
+    int phase = 0;
+    double budget = 0.05;
+    // Tile offsets of each phase, in ordered dither order so that the
+    // coverage is even after every phase.
+    std::vector<std::pair<int, int>> order = {{0, 0}};
+
+    // Which tiles have been rendered since the last reset. Others are filled
+    // with their phase 0 neighbor.
+    int xTiles = 0;
+    int yTiles = 0;
+    std::vector<uint8_t> rendered;
+};
+
+static constexpr int MAX_INTERLACE = 8;
+
+void setInterlace(ProgressiveRefinement& pr, int interlace)
+{
+    pr.interlace = interlace;
+    pr.phase = 0;
+    pr.order.assign(interlace * interlace, {0, 0});
+
+    int bits = 0;
+    while ((1 << bits) < interlace)
+        bits++;
+
+    // Bayer matrix index, i.e. bit-reversed interleaving of x^y and y.
+    for (int y = 0; y < interlace; ++y)
+    for (int x = 0; x < interlace; ++x)
+    {
+        int index = 0;
+        for (int i = 0; i < bits; ++i)
+            index = (index << 2) | ((((x ^ y) >> i) & 1) << 1) | ((y >> i) & 1);
+        pr.order[index] = {x, y};
+    }
+}
+
+void resetProgressive(ProgressiveRefinement& pr)
+{
+    pr.phase = 0;
+    std::fill(pr.rendered.begin(), pr.rendered.end(), 0);
+}
+
+// True when every tile has been rendered since the last reset, and the tile
+// grid is still the same.
+bool isProgressiveComplete(const ProgressiveRefinement& pr)
+{
+    return pr.rendered.size() != 0 &&
+        std::find(pr.rendered.begin(), pr.rendered.end(), 0) == pr.rendered.end();
+}
+
+// Sets the tile subset of the next phase.
+void beginProgressiveFrame(ViewerResources& res, ProgressiveRefinement& pr, int width, int height)
+{
+    int xTiles = (width + res.shader.tileWidth - 1) / res.shader.tileWidth;
+    int yTiles = (height + res.shader.tileHeight - 1) / res.shader.tileHeight;
+    if (xTiles != pr.xTiles || yTiles != pr.yTiles)
+    {
+        pr.xTiles = xTiles;
+        pr.yTiles = yTiles;
+        pr.rendered.assign(xTiles * yTiles, 0);
+        resetProgressive(pr);
+    }
+
+    auto [x, y] = pr.order[pr.phase];
+    res.tileSubset = {pr.interlace, x, y};
+}
+
+// Marks the tiles of the phase done, fills in the holes and picks the next
+// phase based on how long this one took.
+void endProgressiveFrame(ViewerResources& res, ProgressiveRefinement& pr, uint32_t* pixels, int width, int height, double renderTime)
+{
+    const TileSubset& subset = res.tileSubset;
+    for (int y = subset.offsetY; y < pr.yTiles; y += subset.step)
+    for (int x = subset.offsetX; x < pr.xTiles; x += subset.step)
+        pr.rendered[x + y * pr.xTiles] = 1;
+    res.tileSubset = TileSubset();
+
+    int tw = res.shader.tileWidth;
+    int th = res.shader.tileHeight;
+    for (int y = 0; y < pr.yTiles; ++y)
+    for (int x = 0; x < pr.xTiles; ++x)
+    {
+        int sx = x - x % pr.interlace;
+        int sy = y - y % pr.interlace;
+        if (pr.rendered[x + y * pr.xTiles] || !pr.rendered[sx + sy * pr.xTiles])
+            continue;
+
+        int copyWidth = std::min(tw, width - x * tw);
+        int copyHeight = std::min(th, height - y * th);
+        for (int row = 0; row < copyHeight; ++row)
+        {
+            memcpy(
+                pixels + (y * th + row) * width + x * tw,
+                pixels + (sy * th + row) * width + sx * tw,
+                copyWidth * sizeof(uint32_t));
+        }
+    }
+
+    if (renderTime > pr.budget && pr.interlace < MAX_INTERLACE)
+    {
+        // Without interlacing, frames may go straight to the window surface
+        // instead of the framebuffer that's kept around, so start over.
+        if (pr.interlace == 1)
+            resetProgressive(pr);
+        setInterlace(pr, pr.interlace * 2);
+    }
+    else if (pr.interlace > 1 && renderTime * 4 < pr.budget * 0.5)
+        setInterlace(pr, pr.interlace / 2);
+    else
+        pr.phase = (pr.phase + 1) % pr.order.size();
+}
+
+// Mouse state in window coordinates, turned into iMouse by applyMouse().
+// Like on ShaderToy, xy follows the cursor while the left button is held,
+// zw is where it was pressed, z is negative when it's not held anymore and
+// w is only positive on the first frame after the press.
+struct MouseState
+{
+    // iMouse stays zero until the first click.
+    bool active = false;
+    bool down = false;
+    bool clicked = false;
+    float x = 0.0f;
+    float y = 0.0f;
+    float clickX = 0.0f;
+    float clickY = 0.0f;
+    // Set when iMouse changes, cleared after a frame is rendered with it.
+    bool changed = false;
+};
+
+bool handleMouseEvent(MouseState& mouse, const SDL_Event& event)
+{
+    switch (event.type)
+    {
+    case SDL_EVENT_MOUSE_MOTION:
+        if (!mouse.down)
+            return false;
+        mouse.x = event.motion.x;
+        mouse.y = event.motion.y;
+        break;
+    case SDL_EVENT_MOUSE_BUTTON_DOWN:
+        if (event.button.button != SDL_BUTTON_LEFT)
+            return false;
+        mouse.active = true;
+        mouse.down = true;
+        mouse.clicked = true;
+        mouse.x = mouse.clickX = event.button.x;
+        mouse.y = mouse.clickY = event.button.y;
+        break;
+    case SDL_EVENT_MOUSE_BUTTON_UP:
+        if (event.button.button != SDL_BUTTON_LEFT)
+            return false;
+        mouse.down = false;
+        break;
+    default:
+        return false;
+    }
+    mouse.changed = true;
+    return true;
+}
+
+// In pixels of the rendered resolution, with y going up.
+void applyMouse(const MouseState& mouse, ShaderViewerConstants& params, int windowWidth, int windowHeight, int renderWidth, int renderHeight)
+{
+    if (!mouse.active)
+    {
+        params.mouseX = params.mouseY = params.mouseClickX = params.mouseClickY = 0.0f;
+        return;
+    }
+
+    float sx = float(renderWidth) / windowWidth;
+    float sy = float(renderHeight) / windowHeight;
+    params.mouseX = mouse.x * sx;
+    params.mouseY = (windowHeight - mouse.y) * sy;
+    params.mouseClickX = mouse.clickX * sx * (mouse.down ? 1.0f : -1.0f);
+    params.mouseClickY = (windowHeight - mouse.clickY) * sy * (mouse.clicked ? 1.0f : -1.0f);
+}
+
+void interactiveMain(const char* frameStatsPath)
+{
+    ViewerResources res = init();
+    loadShader(res, nullptr);
+
+    ShaderBuilder builder;
+    startShaderBuilder(res, builder);
+
+    uint64_t prevTicks = SDL_GetTicksNS();
+    uint64_t epochTicks = prevTicks;
+
+    std::string activeShaderPath = "";
+    SDL_Time shaderModifyTime;
+
+    std::vector<uint32_t> framebuffer;
+
+    auto& params = *res.constants;
+    params.frame = 0;
+    params.mouseX = 0;
+    params.mouseY = 0;
+    params.mouseClickX = 0;
+    params.mouseClickY = 0;
+
+    bool valid = false;
+
+    // Heap allocated, the histograms are a bit large for the stack.
+    std::unique_ptr<FramePacingStats> pacing(new FramePacingStats());
+    bool showPacing = false;
+    uint64_t pacingReportTicks = prevTicks;
+
+    RenderScale renderScale;
+    ProgressiveRefinement progressive;
+    int renderWidth = res.surf->w;
+    int renderHeight = res.surf->h;
+
+    // Frames are only rendered when something the shader reads changed.
+    bool paused = false;
+    uint64_t pauseTicks = 0;
+    bool forceRender = true;
+    bool renderedLast = false;
+    float renderedTime = 0.0f;
+    int idleWaitMs = 50;
+
+    // With mouse throttling, frames that only changed because of the mouse
+    // are rendered at most at the display's refresh rate.
+    MouseState mouse;
+    bool throttleMouse = false;
+    uint64_t lastRenderTicks = 0;
+    uint64_t refreshTicks = 1000000000 / 60;
+    if (const SDL_DisplayMode* mode = SDL_GetCurrentDisplayMode(SDL_GetDisplayForWindow(res.window)))
+    {
+        if (mode->refresh_rate > 0)
+            refreshTicks = 1e9 / mode->refresh_rate;
+    }
+
+    for(;;)
+    {
+        // Nothing changed last time, so sleep until an event comes in or it's
+        // time to check for shader changes again.
+        if (!renderedLast)
+            SDL_WaitEventTimeout(nullptr, idleWaitMs);
+        idleWaitMs = 50;
+
+        uint64_t curTicks = SDL_GetTicksNS();
+
+        float totalTime = ((paused ? pauseTicks : curTicks) - epochTicks) * 1e-9f;
+
+        params.time = totalTime;
+        if (valid && renderedLast)
+        {
+            recordLatency(pacing->frame, curTicks - prevTicks);
+            updateRenderScale(renderScale, (curTicks - prevTicks) * 1e-9);
+        }
+
+        if (showPacing && curTicks - pacingReportTicks >= 1000000000)
+        {
+            std::string summary =
+                summarizeLatency("frame", pacing->frame, true) + " | " +
+                summarizeLatency("render", pacing->render, true) + " | " +
+                std::to_string(pacing->frame.hitches) + " hitches";
+            printf("%s\n", summary.c_str());
+            SDL_SetWindowTitle(res.window, summary.c_str());
+            pacingReportTicks = curTicks;
+        }
+
+        prevTicks = curTicks;
+
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            if (handleMouseEvent(mouse, event))
+                continue;
+
+            switch (event.type)
+            {
+            case SDL_EVENT_KEY_DOWN:
+                // Most keys change how the frame looks.
+                forceRender = true;
+                if (event.key.key == SDLK_Q)
+                    goto end;
+                if (event.key.key == SDLK_R)
+                {
+                    epochTicks = curTicks;
+                    pauseTicks = curTicks;
+                }
+                if (event.key.key == SDLK_SPACE)
+                {
+                    // Time continues from where it was paused.
+                    if (paused)
+                        epochTicks += curTicks - pauseTicks;
+                    else
+                        pauseTicks = curTicks;
+                    paused = !paused;
+                }
+                if (event.key.key == SDLK_H)
+                {
+                    res.tileTiming.enabled = !res.tileTiming.enabled;
+                    resetTileTiming(res, renderWidth, renderHeight);
+                }
+                if (event.key.key == SDLK_S)
+                {
+                    // Full, half and quarter resolution.
+                    renderScale.adaptive = false;
+                    renderScale.scale = renderScale.scale > 0.75f ? 0.5f :
+                        renderScale.scale > 0.375f ? 0.25f : 1.0f;
+                    printf("Render scale: %g\n", renderScale.scale);
+                }
+                if (event.key.key == SDLK_A)
+                {
+                    renderScale.adaptive = !renderScale.adaptive;
+                    renderScale.averageFrameTime = 0.0;
+                    printf("Adaptive render scale: %s\n", renderScale.adaptive ? "on" : "off");
+                }
+                if (event.key.key == SDLK_F)
+                {
+                    renderScale.linear = !renderScale.linear;
+                    printf("Upscaling: %s\n", renderScale.linear ? "bilinear" : "nearest");
+                }
+                if (event.key.key == SDLK_I)
+                {
+                    progressive.enabled = !progressive.enabled;
+                    setInterlace(progressive, 1);
+                    printf("Progressive refinement: %s\n", progressive.enabled ? "on" : "off");
+                }
+                if (event.key.key == SDLK_B)
+                {
+                    // Cycles through synchronous, double and triple buffered.
+                    int buffers = res.presentBuffers % 3 + 1;
+                    startFramePresenter(res, buffers);
+                    printf("Present buffers: %d\n", buffers);
+                }
+                if (event.key.key == SDLK_M)
+                {
+                    throttleMouse = !throttleMouse;
+                    printf("Mouse throttling: %s\n", throttleMouse ? "on" : "off");
+                }
+                if (event.key.key == SDLK_P)
+                {
+                    showPacing = !showPacing;
+                    if (!showPacing)
+                        SDL_SetWindowTitle(res.window, "CPU shader viewer");
+                }
+                break;
+            case SDL_EVENT_DROP_FILE:
+                {
+                    SDL_PathInfo info;
+                    if (SDL_GetPathInfo(event.drop.data, &info))
+                        requestShaderBuild(builder, event.drop.data, info.modify_time);
+                }
+                break;
+            case SDL_EVENT_WINDOW_EXPOSED:
+                forceRender = true;
+                break;
+            case SDL_EVENT_QUIT:
+                goto end;
+            }
+        }
+
+        SDL_PathInfo info;
+        if (SDL_GetPathInfo(activeShaderPath.c_str(), &info))
+        {
+            if (shaderModifyTime < info.modify_time)
+            {
+                shaderModifyTime = info.modify_time;
+                requestShaderBuild(builder, activeShaderPath, info.modify_time);
+            }
+        }
+
+        {
+            // No frame is being rendered right now, so swapping the shader
+            // here is safe. A failed build keeps the last good shader.
+            std::lock_guard<std::mutex> lock(builder.mutex);
+            if (builder.hasResult)
+            {
+                builder.hasResult = false;
+                if (builder.resultOk)
+                {
+                    res.shader = std::move(builder.result);
+                    builder.result = CompiledShader();
+                    setMultipass(res, std::move(builder.resultMultipass));
+                    resetTileTiming(res, renderWidth, renderHeight);
+                    resetProgressive(progressive);
+                    forceRender = true;
+                    activeShaderPath = builder.resultRequest.path;
+                    shaderModifyTime = builder.resultRequest.modifyTime;
+                    valid = true;
+                }
+                else if (activeShaderPath.empty())
+                {
+                    // Keep watching a file that never built, so fixing it
+                    // gets picked up too.
+                    activeShaderPath = builder.resultRequest.path;
+                    shaderModifyTime = builder.resultRequest.modifyTime;
+                }
+            }
+        }
+
+        int scaledWidth = std::max(1, int(res.surf->w * renderScale.scale + 0.5f));
+        int scaledHeight = std::max(1, int(res.surf->h * renderScale.scale + 0.5f));
+        if (scaledWidth != renderWidth || scaledHeight != renderHeight)
+        {
+            renderWidth = scaledWidth;
+            renderHeight = scaledHeight;
+            if (res.tileTiming.enabled)
+                resetTileTiming(res, renderWidth, renderHeight);
+            forceRender = true;
+        }
+
+        uint32_t inputs = res.shader.inputs;
+        bool mouseChanged = (inputs & SHADER_INPUT_MOUSE) && mouse.changed;
+        bool changed = forceRender ||
+            ((inputs & SHADER_INPUT_TIME) && totalTime != renderedTime) ||
+            ((inputs & SHADER_INPUT_FRAME) && !paused) ||
+            (progressive.enabled && !isProgressiveComplete(progressive));
+
+        // Mouse events after this keep accumulating into the next frame.
+        if (!changed && mouseChanged && throttleMouse && curTicks - lastRenderTicks < refreshTicks)
+        {
+            renderedLast = false;
+            idleWaitMs = std::max(int((refreshTicks - (curTicks - lastRenderTicks)) / 1000000), 1);
+            continue;
+        }
+
+        changed = changed || mouseChanged;
+        renderedLast = changed;
+        if (!changed)
+        {
+            // The last submitted frame is otherwise only shown by the next
+            // acquireFramebuffer(), which may never come.
+            if (res.presenter)
+                drainFramePresenter(res, 0);
+            continue;
+        }
+        forceRender = false;
+        renderedTime = totalTime;
+        lastRenderTicks = curTicks;
+
+        applyMouse(mouse, params, res.surf->w, res.surf->h, renderWidth, renderHeight);
+        mouse.changed = false;
+        if (mouse.clicked)
+        {
+            // w goes negative on the next frame.
+            mouse.clicked = false;
+            mouse.changed = true;
+        }
+
+        // Scaled and interlaced frames are always presented synchronously,
+        // after whatever the presenter thread still had queued. Interlacing
+        // needs the earlier frames to stay in the framebuffer.
+        bool scaled = renderWidth != res.surf->w || renderHeight != res.surf->h;
+        bool interlaced = progressive.enabled && progressive.interlace > 1;
+        bool synchronous = scaled || interlaced;
+        if (synchronous && res.presenter)
+            drainFramePresenter(res, 0);
+        bool direct = !synchronous && canRenderToSurface(res);
+        int pitch = renderWidth;
+        size_t framebufferSize = size_t(renderWidth) * renderHeight;
+        uint32_t* pixels;
+        if (direct)
+        {
+            SDL_LockSurface(res.surf);
+            pitch = res.surf->pitch / 4;
+            framebufferSize = size_t(pitch) * res.surf->h;
+            pixels = (uint32_t*)res.surf->pixels;
+        }
+        else if (res.presenter && !synchronous)
+            pixels = acquireFramebuffer(res, framebufferSize);
+        else
+        {
+            framebuffer.resize(framebufferSize);
+            pixels = framebuffer.data();
+        }
+
+        res.globalParams.pixelData = pixels;
+        res.globalParams.pixelDataSize = framebufferSize;
+        params.pitch = pitch;
+        params.resX = renderWidth;
+        params.resY = renderHeight;
+        params.resZ = 1;
+
+        if (progressive.enabled)
+            beginProgressiveFrame(res, progressive, renderWidth, renderHeight);
+
+        uint64_t renderStartTicks = SDL_GetTicksNS();
+        if (res.multipass)
+            renderBufferPasses(res, renderWidth, renderHeight, true);
+        renderFrameMultithread(res, renderWidth, renderHeight, getTileFunc(res));
+
+        if (progressive.enabled)
+        {
+            double renderTime = (SDL_GetTicksNS() - renderStartTicks) * 1e-9;
+            endProgressiveFrame(res, progressive, pixels, renderWidth, renderHeight, renderTime);
+        }
+
+        // Blending in place would stack up on tiles that weren't re-rendered.
+        if (res.tileTiming.enabled && !interlaced)
+        {
+            res.tileTiming.frames++;
+            overlayTileHeatmap(res.tileTiming, pixels, renderWidth, renderHeight, pitch, res.shader.pixelFormat);
+        }
+
+        uint64_t presentStartTicks = SDL_GetTicksNS();
+        if (direct)
+        {
+            SDL_UnlockSurface(res.surf);
+            SDL_UpdateWindowSurface(res.window);
+        }
+        else if (scaled)
+            presentScaledFramebuffer(res, pixels, renderWidth, renderHeight, renderScale.linear);
+        else if (res.presenter)
+            submitFramebuffer(res);
+        else
+            presentFramebuffer(res, pixels);
+        uint64_t presentEndTicks = SDL_GetTicksNS();
+
+        if (valid)
+        {
+            recordLatency(pacing->render, presentStartTicks - renderStartTicks);
+            recordLatency(pacing->present, presentEndTicks - presentStartTicks);
+        }
+
+        params.frame++;
+    }
+
+end:
+
+    if (frameStatsPath)
+        dumpFramePacingStats(*pacing, frameStatsPath);
+
+    stopShaderBuilder(builder);
+    deinit(res);
+}
+
+void skipWhitespace(const char*& str)
+{
+    while(*str != 0 && strchr(" \t\n", *str)) str++;
+}
+
+std::string readUntilWhitespace(const char*& str)
+{
+    std::string token;
+    while (*str != ' ' && *str != '\t' && *str)
+    {
+        token += *str;
+        str++;
+    }
+    return token;
+}
+
+bool readDouble(const std::string& str, double& d)
+{
+    char* out = nullptr;
+    d = strtod(str.c_str(), &out);
+    return *out == 0;
+}
+
+std::vector<std::string> splitByWhitespace(const char* str)
+{
+    std::vector<std::string> args;
+    skipWhitespace(str);
+    while (*str)
+    {
+        args.push_back(readUntilWhitespace(str));
+        skipWhitespace(str);
+    }
+    return args;
+}
+
+// Sums in double with Kahan compensation, so that large sample counts of
+// tiny frame times don't lose precision.
+double sum(const std::vector<float>& vals)
+{
+    double s = 0.0;
+    double c = 0.0;
+    for (float v: vals)
+    {
+        double y = v - c;
+        double t = s + y;
+        c = (t - s) - y;
+        s = t;
+    }
+    return s;
+}
+
+double mean(const std::vector<float>& vals)
+{
+    if (vals.size() == 0)
+        return 0.0;
+    return sum(vals) / vals.size();
+}
+
+double min(const std::vector<float>& vals)
+{
+    if (vals.size() == 0)
+        return 0.0;
+    return *std::min_element(vals.begin(), vals.end());
+}
+
+double max(const std::vector<float>& vals)
+{
+    if (vals.size() == 0)
+        return 0.0;
+    return *std::max_element(vals.begin(), vals.end());
+}
+
+// Order statistics need a modifiable copy, this keeps its allocation around.
+std::vector<float>& getSortScratch(const std::vector<float>& vals)
+{
+    thread_local std::vector<float> scratch;
+    scratch.assign(vals.begin(), vals.end());
+    return scratch;
+}
+
+double median(const std::vector<float>& vals)
+{
+    if (vals.size() == 0)
+        return 0.0;
+
+    std::vector<float>& v = getSortScratch(vals);
+    std::nth_element(v.begin(), v.begin() + v.size()/2, v.end());
+    return v[v.size()/2];
+}
+
+// Linearly interpolated between the closest ranks, p in [0, 100].
+double percentile(const std::vector<float>& vals, double p)
+{
+    if (vals.size() == 0)
+        return 0.0;
+
+    std::vector<float>& v = getSortScratch(vals);
+    double rank = std::clamp(p / 100.0, 0.0, 1.0) * (v.size() - 1);
+    size_t lower = std::floor(rank);
+    size_t upper = std::min(lower + 1, v.size() - 1);
+
+    std::nth_element(v.begin(), v.begin() + lower, v.end());
+    double low = v[lower];
+    // After nth_element, everything past lower is at least as large, so the
+    // next rank is the smallest of those.
+    double high = upper == lower ? low : *std::min_element(v.begin() + upper, v.end());
+    return low + (high - low) * (rank - lower);
+}
+
+// In the log domain, a plain product underflows after a few hundred frames.
+double geomean(const std::vector<float>& vals)
+{
+    if (vals.size() == 0)
+        return 0.0;
+
+    double s = 0.0;
+    for (float v: vals)
+        s += log(v);
+    return exp(s / vals.size());
+}
+
+double harmonicMean(const std::vector<float>& vals)
+{
+    if (vals.size() == 0)
+        return 0.0;
+
+    double s = 0.0;
+    for (float v: vals)
+        s += 1.0 / v;
+    return vals.size() / s;
+}
+
+double variance(const std::vector<float>& vals)
+{
+    if (vals.size() == 0)
+        return 0.0;
+
+    double m = mean(vals);
+    double s = 0.0;
+    for (float v: vals)
+        s += (m-v) * (m-v);
+    return s / vals.size();
+}
+
+enum class Cumulation
+{
+    LAST,
+    SUM,
+    MEAN,
+    MIN,
+    MAX,
+    MEDIAN,
+    PERCENTILE,
+    GEOMEAN,
+    HARMONIC_MEAN,
+    VARIANCE,
+    STDDEV
+};
+
+struct CumulationSpec
+{
+    Cumulation type = Cumulation::LAST;
+    double percentile = 0.0;
+};
+
+bool parseCumulation(const std::string& name, CumulationSpec& spec)
+{
+    static const std::pair<const char*, Cumulation> names[] = {
+        {"sum", Cumulation::SUM},
+        {"mean", Cumulation::MEAN},
+        {"min", Cumulation::MIN},
+        {"max", Cumulation::MAX},
+        {"median", Cumulation::MEDIAN},
+        {"geomean", Cumulation::GEOMEAN},
+        {"harmonic-mean", Cumulation::HARMONIC_MEAN},
+        {"variance", Cumulation::VARIANCE},
+        {"stddev", Cumulation::STDDEV}
+    };
+    for (auto [n, type]: names)
+    {
+        if (name == n)
+        {
+            spec.type = type;
+            return true;
+        }
+    }
+
+    // pNN, e.g. p99 or p99.9
+    double p;
+    if (name.size() > 1 && name[0] == 'p' && readDouble(name.substr(1), p) && p >= 0 && p <= 100)
+    {
+        spec.type = Cumulation::PERCENTILE;
+        spec.percentile = p;
+        return true;
+    }
+    return false;
+}
+
+double collect(const std::vector<float>& vals, const CumulationSpec& spec)
+{
+    switch (spec.type)
+    {
+    case Cumulation::LAST:
+        return vals.size() == 0 ? 0 : vals.back();
+    case Cumulation::SUM:
+        return sum(vals);
+    case Cumulation::MEAN:
+        return mean(vals);
+    case Cumulation::MIN:
+        return min(vals);
+    case Cumulation::MAX:
+        return max(vals);
+    case Cumulation::MEDIAN:
+        return median(vals);
+    case Cumulation::PERCENTILE:
+        return percentile(vals, spec.percentile);
+    case Cumulation::GEOMEAN:
+        return geomean(vals);
+    case Cumulation::HARMONIC_MEAN:
+        return harmonicMean(vals);
+    case Cumulation::VARIANCE:
+        return variance(vals);
+    case Cumulation::STDDEV:
+        return sqrt(variance(vals));
+    }
+    return 0;
+}
+
+// A parsed ${...} of 'print'. Prefixes are listed outermost first.
+struct StatSpec
+{
+    std::string text;
+    std::string var;
+    std::vector<std::string> prefixNames;
+    std::vector<CumulationSpec> prefixes;
+};
+
+StatSpec compileStatSpec(const std::string& text)
+{
+    StatSpec spec;
+    spec.text = text;
+    spec.prefixNames = splitByWhitespace(text.c_str());
+
+    if (spec.prefixNames.size() == 0)
+        panic("No variable name given!");
+
+    spec.var = spec.prefixNames.back();
+    spec.prefixNames.pop_back();
+
+    if (spec.prefixNames.size() > 2)
+        panic("Too many cumulation prefixes in \"%s\"!\n", text.c_str());
+
+    for (const std::string& name: spec.prefixNames)
+    {
+        CumulationSpec c;
+        if (!parseCumulation(name, c))
+            panic("Unknown cumulation prefix %s\n", name.c_str());
+        spec.prefixes.push_back(c);
+    }
+    return spec;
+}
+
+struct HostInfo
+{
+    std::string cpuModel;
+    int logicalCores = 0;
+    std::string platform;
+    std::string slangVersion;
+    std::string llvmVersion;
+};
+
+struct RunStats
+{
+    std::string shaderPath;
+    // describeShaderOptions() of what the shader was built with.
+    std::string config;
+    // Name and details of the machine that rendered the run, they differ in
+    // distributed benchmarks.
+    std::string host;
+    HostInfo hostInfo;
+    int64_t codeSize = -1;
+    // Counts of remark lines, from 'option remarks on'.
+    int vectorizedRemarks = 0;
+    int missedVectorizationRemarks = 0;
+    std::string remarks;
+    int width;
+    int height;
+    float buildTime;
+    bool buildFromCache;
+    float sessionTime;
+    int threads;
+    // Includes warmup frames and frames dropped by until-cv or outlier
+    // rejection.
+    int framesRendered;
+    int rejectedFrames;
+    // With 'batch', each entry of frames and counters is the mean of a whole
+    // batch of this many frames, so that until-cv, reject and baseline
+    // comparisons don't see K copies of the same sample.
+    int framesPerSample = 1;
+    std::vector<float> frames;
+    // Per-frame perf counter values of the recorded frames, dropped along
+    // with rejected frames so that they stay aligned with frames.
+    std::map<std::string, std::vector<float>> counters;
+    // With 'capture', one hash per recorded frame or only the final frame's.
+    std::vector<uint64_t> frameHashes;
+    // Of the final frame against the golden image. NAN when not compared,
+    // INFINITY when identical.
+    double psnr = NAN;
+    bool outputMismatch = false;
+
+    // Cumulated values of frames and counters, keyed by "<prefix> <var>".
+    // Runs don't change after they're recorded, so these never go stale.
+    mutable std::map<std::string, double> summaries;
+};
+
+struct Stats
+{
+    std::vector<RunStats> runs;
+    // Not cleared, prebuilding happens before any command is run.
+    float buildWallclock = 0.0f;
+    // Startup phases, not cleared either. Negative until they've happened.
+    float parseTime = 0.0f;
+    float sdlInitTime = 0.0f;
+    float globalSessionTime = -1.0f;
+    float firstBuildTime = -1.0f;
+
+    void clear()
+    {
+        runs.clear();
+    }
+
+    // Perf counters are only known once they're recorded, but the default
+    // ones should work in print even when counters aren't enabled.
+    bool isCounter(const std::string& var) const
+    {
+        if (var == "ipc")
+            return true;
+        for (const PerfCounterDesc& desc: getDefaultPerfCounters())
+            if (desc.name == var)
+                return true;
+        for (const RunStats& r: runs)
+            if (r.counters.count(var))
+                return true;
+        return false;
+    }
+
+    double summarize(const RunStats& r, const std::string& var, const std::string& prefixName, const CumulationSpec& prefix) const
+    {
+        static const std::vector<float> empty;
+
+        std::string key = prefixName + " " + var;
+        auto cached = r.summaries.find(key);
+        if (cached != r.summaries.end())
+            return cached->second;
+
+        auto it = r.counters.find(var);
+        const std::vector<float>& series =
+            var == "frame-time" ? r.frames :
+            it != r.counters.end() ? it->second : empty;
+        double value = collect(series, prefix);
+        if (prefix.type == Cumulation::SUM)
+            value *= r.framesPerSample;
+        r.summaries[key] = value;
+        return value;
+    }
+
+    double getStat(const StatSpec& spec) const
+    {
+        const std::string& var = spec.var;
+        size_t prefixCount = spec.prefixes.size();
+
+        std::vector<float> stats;
+        if (var == "build-time")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.buildTime);
+        }
+        else if (var == "total-build-wallclock")
+        {
+            stats.push_back(buildWallclock);
+        }
+        else if (var == "parse-time")
+        {
+            stats.push_back(parseTime);
+        }
+        else if (var == "sdl-init-time")
+        {
+            stats.push_back(sdlInitTime);
+        }
+        else if (var == "global-session-time")
+        {
+            stats.push_back(globalSessionTime);
+        }
+        else if (var == "first-build-time")
+        {
+            stats.push_back(firstBuildTime);
+        }
+        else if (var == "frames-rendered")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.framesRendered);
+        }
+        else if (var == "rejected-frames")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.rejectedFrames);
+        }
+        else if (var == "session-time")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.sessionTime);
+        }
+        else if (var == "code-size")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.codeSize);
+        }
+        else if (var == "vectorized")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.vectorizedRemarks);
+        }
+        else if (var == "vectorize-missed")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.missedVectorizationRemarks);
+        }
+        else if (var == "psnr")
+        {
+            for (const RunStats& r: runs)
+                if (!std::isnan(r.psnr))
+                    stats.push_back(r.psnr);
+        }
+        else if (var == "output-mismatch")
+        {
+            for (const RunStats& r: runs)
+                stats.push_back(r.outputMismatch ? 1 : 0);
+        }
+        else if (var == "cold-build-time")
+        {
+            for (const RunStats& r: runs)
+                if (!r.buildFromCache)
+                    stats.push_back(r.buildTime);
+        }
+        else if (var == "warm-build-time")
+        {
+            for (const RunStats& r: runs)
+                if (r.buildFromCache)
+                    stats.push_back(r.buildTime);
+        }
+        else if (var == "frame-time" || isCounter(var))
+        {
+            // The innermost prefix cumulates the frames of each run.
+            CumulationSpec perRun;
+            std::string perRunName;
+            if (prefixCount >= 1)
+            {
+                perRun = spec.prefixes.back();
+                perRunName = spec.prefixNames.back();
+                prefixCount--;
+            }
+
+            for (const RunStats& r: runs)
+                stats.push_back(summarize(r, var, perRunName, perRun));
+        }
+        else
+            panic("Unknown variable %s\n", var.c_str());
+
+        if (prefixCount > 1)
+            panic("Too many cumulation prefixes in \"%s\"!\n", spec.text.c_str());
+
+        return collect(stats, prefixCount == 0 ? CumulationSpec() : spec.prefixes[0]);
+    }
+};
+
+std::string getHostName()
+{
+    char name[256];
+    if (gethostname(name, sizeof(name)) != 0)
+        return "unknown";
+    name[sizeof(name) - 1] = 0;
+    return name;
+}
+
+HostInfo getHostInfo(ViewerResources& res)
+{
+    HostInfo info;
+    info.cpuModel = "unknown";
+    info.logicalCores = SDL_GetNumLogicalCPUCores();
+    info.platform = SDL_GetPlatform();
+    info.slangVersion = spGetBuildTagString();
+#ifdef VIEWER_LLVM_VERSION
+    info.llvmVersion = VIEWER_LLVM_VERSION;
+#else
+    info.llvmVersion = "unknown";
+#endif
+
+    FILE* f = fopen("/proc/cpuinfo", "rb");
+    if (f)
+    {
+        char line[512];
+        while (fgets(line, sizeof(line), f))
+        {
+            if (strncmp(line, "model name", 10) != 0)
+                continue;
+            const char* value = strchr(line, ':');
+            if (!value)
+                continue;
+            value++;
+            skipWhitespace(value);
+            info.cpuModel = value;
+            while (info.cpuModel.size() && strchr(" \t\r\n", info.cpuModel.back()))
+                info.cpuModel.pop_back();
+            break;
+        }
+        fclose(f);
+    }
+    return info;
+}
+
+// Percentile bootstrap, returns the confidence interval of the mean and the
+// median. Fixed seed, so the same samples always give the same interval.
+struct BootstrapInterval
+{
+    float meanLow, meanHigh;
+    float medianLow, medianHigh;
+};
+
+BootstrapInterval bootstrap(const std::vector<float>& samples, int resamples, float confidence)
+{
+    BootstrapInterval ci = {};
+    if (samples.size() == 0 || resamples <= 0)
+        return ci;
+
+    std::mt19937_64 rng(0);
+    std::uniform_int_distribution<size_t> pick(0, samples.size()-1);
+    std::vector<float> resampled(samples.size());
+    std::vector<float> means(resamples), medians(resamples);
+    for (int i = 0; i < resamples; ++i)
+    {
+        double sum = 0.0;
+        for (float& s: resampled)
+        {
+            s = samples[pick(rng)];
+            sum += s;
+        }
+        means[i] = sum / resampled.size();
+        std::nth_element(resampled.begin(), resampled.begin() + resampled.size()/2, resampled.end());
+        medians[i] = resampled[resampled.size()/2];
+    }
+
+    std::sort(means.begin(), means.end());
+    std::sort(medians.begin(), medians.end());
+    size_t low = std::floor((1.0f - confidence) * 0.5f * (resamples - 1));
+    size_t high = std::ceil((1.0f + confidence) * 0.5f * (resamples - 1));
+    ci.meanLow = means[low];
+    ci.meanHigh = means[high];
+    ci.medianLow = medians[low];
+    ci.medianHigh = medians[high];
+    return ci;
+}
+
+std::string escapeJSON(const std::string& str)
+{
+    std::string out;
+    for (char c: str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else out += c;
+    }
+    return out;
+}
+
+std::string escapeCSV(const std::string& str)
+{
+    if (str.find_first_of(",\"\n") == std::string::npos)
+        return str;
+    std::string out = "\"";
+    for (char c: str)
+    {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+void exportStatsJSON(const Stats& stats, const HostInfo& host, const char* path, int bootstrapResamples)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) panic("Unable to open %s\n", path);
+
+    fprintf(f, "{\n  \"host\": {\n");
+    fprintf(f, "    \"cpu\": \"%s\",\n", escapeJSON(host.cpuModel).c_str());
+    fprintf(f, "    \"logical_cores\": %d,\n", host.logicalCores);
+    fprintf(f, "    \"platform\": \"%s\",\n", escapeJSON(host.platform).c_str());
+    fprintf(f, "    \"slang_version\": \"%s\",\n", escapeJSON(host.slangVersion).c_str());
+    fprintf(f, "    \"llvm_version\": \"%s\"\n", escapeJSON(host.llvmVersion).c_str());
+    fprintf(f, "  },\n  \"startup\": {\n");
+    fprintf(f, "    \"parse_time\": %.9g,\n", stats.parseTime);
+    fprintf(f, "    \"sdl_init_time\": %.9g,\n", stats.sdlInitTime);
+    fprintf(f, "    \"global_session_time\": %.9g,\n", stats.globalSessionTime);
+    fprintf(f, "    \"first_build_time\": %.9g\n", stats.firstBuildTime);
+    fprintf(f, "  },\n  \"runs\": [");
+
+    for (size_t i = 0; i < stats.runs.size(); ++i)
+    {
+        const RunStats& r = stats.runs[i];
+        fprintf(f, "%s\n    {\n", i == 0 ? "" : ",");
+        fprintf(f, "      \"shader\": \"%s\",\n", escapeJSON(r.shaderPath).c_str());
+        fprintf(f, "      \"config\": \"%s\",\n", escapeJSON(r.config).c_str());
+        fprintf(f, "      \"host\": \"%s\",\n", escapeJSON(r.host).c_str());
+        fprintf(f, "      \"host_info\": {\"cpu\": \"%s\", \"logical_cores\": %d, \"platform\": \"%s\", "
+            "\"slang_version\": \"%s\", \"llvm_version\": \"%s\"},\n",
+            escapeJSON(r.hostInfo.cpuModel).c_str(), r.hostInfo.logicalCores,
+            escapeJSON(r.hostInfo.platform).c_str(), escapeJSON(r.hostInfo.slangVersion).c_str(),
+            escapeJSON(r.hostInfo.llvmVersion).c_str());
+        fprintf(f, "      \"code_size\": %lld,\n", (long long)r.codeSize);
+        fprintf(f, "      \"vectorized_remarks\": %d,\n", r.vectorizedRemarks);
+        fprintf(f, "      \"missed_vectorization_remarks\": %d,\n", r.missedVectorizationRemarks);
+        if (!r.frameHashes.empty())
+        {
+            fprintf(f, "      \"frame_hashes\": [");
+            for (size_t j = 0; j < r.frameHashes.size(); ++j)
+                fprintf(f, "%s\"%016llx\"", j == 0 ? "" : ", ", (unsigned long long)r.frameHashes[j]);
+            fprintf(f, "],\n");
+        }
+        if (!std::isnan(r.psnr))
+        {
+            // JSON has no infinity, identical images get null.
+            if (std::isinf(r.psnr))
+                fprintf(f, "      \"psnr\": null,\n");
+            else
+                fprintf(f, "      \"psnr\": %.9g,\n", r.psnr);
+            fprintf(f, "      \"output_mismatch\": %s,\n", r.outputMismatch ? "true" : "false");
+        }
+        fprintf(f, "      \"width\": %d,\n", r.width);
+        fprintf(f, "      \"height\": %d,\n", r.height);
+        fprintf(f, "      \"threads\": %d,\n", r.threads);
+        fprintf(f, "      \"build_time\": %.9g,\n", r.buildTime);
+        fprintf(f, "      \"build_from_cache\": %s,\n", r.buildFromCache ? "true" : "false");
+        fprintf(f, "      \"session_time\": %.9g,\n", r.sessionTime);
+        fprintf(f, "      \"frames_rendered\": %d,\n", r.framesRendered);
+        fprintf(f, "      \"rejected_frames\": %d,\n", r.rejectedFrames);
+        fprintf(f, "      \"frames_per_sample\": %d,\n", r.framesPerSample);
+        if (bootstrapResamples > 0)
+        {
+            BootstrapInterval ci = bootstrap(r.frames, bootstrapResamples, 0.95f);
+            fprintf(f, "      \"bootstrap\": {\n");
+            fprintf(f, "        \"resamples\": %d,\n", bootstrapResamples);
+            fprintf(f, "        \"confidence\": 0.95,\n");
+            fprintf(f, "        \"mean_frame_time\": [%.9g, %.9g],\n", ci.meanLow, ci.meanHigh);
+            fprintf(f, "        \"median_frame_time\": [%.9g, %.9g]\n", ci.medianLow, ci.medianHigh);
+            fprintf(f, "      },\n");
+        }
+        if (r.counters.size() != 0)
+        {
+            fprintf(f, "      \"counters\": {");
+            bool first = true;
+            for (const auto& [name, values]: r.counters)
+            {
+                fprintf(f, "%s\n        \"%s\": [", first ? "" : ",", escapeJSON(name).c_str());
+                for (size_t j = 0; j < values.size(); ++j)
+                    fprintf(f, "%s%.9g", j == 0 ? "" : ", ", values[j]);
+                fprintf(f, "]");
+                first = false;
+            }
+            fprintf(f, "\n      },\n");
+        }
+        fprintf(f, "      \"frame_times\": [");
+        for (size_t j = 0; j < r.frames.size(); ++j)
+            fprintf(f, "%s%.9g", j == 0 ? "" : ", ", r.frames[j]);
+        fprintf(f, "]\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+}
+
+// One row per frame, so that the file can be loaded as a single table.
+void exportStatsCSV(const Stats& stats, const HostInfo& host, const char* path, int bootstrapResamples)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) panic("Unable to open %s\n", path);
+
+    fprintf(f, "cpu,logical_cores,platform,slang_version,llvm_version,"
+        "run,shader,config,host,width,height,threads,build_time,build_from_cache,session_time,"
+        "frames_rendered,rejected_frames,code_size,vectorized_remarks,missed_vectorization_remarks,"
+        "final_hash,psnr,output_mismatch,");
+    if (bootstrapResamples > 0)
+    {
+        fprintf(f, "mean_frame_time_low,mean_frame_time_high,"
+            "median_frame_time_low,median_frame_time_high,");
+    }
+    std::vector<std::string> counterNames;
+    for (const RunStats& r: stats.runs)
+        for (const auto& [name, values]: r.counters)
+            if (std::find(counterNames.begin(), counterNames.end(), name) == counterNames.end())
+                counterNames.push_back(name);
+
+    fprintf(f, "frame,frame_time");
+    for (const std::string& name: counterNames)
+        fprintf(f, ",%s", escapeCSV(name).c_str());
+    fprintf(f, "\n");
+
+    for (size_t i = 0; i < stats.runs.size(); ++i)
+    {
+        const RunStats& r = stats.runs[i];
+        // Of the machine that rendered the run.
+        const HostInfo& runHost = r.hostInfo.platform.empty() ? host : r.hostInfo;
+        std::string hostColumns =
+            escapeCSV(runHost.cpuModel) + "," + std::to_string(runHost.logicalCores) + "," +
+            escapeCSV(runHost.platform) + "," + escapeCSV(runHost.slangVersion) + "," +
+            escapeCSV(runHost.llvmVersion);
+
+        // Empty when not captured or compared.
+        char hash[32] = "";
+        if (!r.frameHashes.empty())
+            snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)r.frameHashes.back());
+        char psnr[32] = "";
+        if (!std::isnan(r.psnr))
+            snprintf(psnr, sizeof(psnr), "%.9g", r.psnr);
+
+        char runColumns[320];
+        snprintf(
+            runColumns, sizeof(runColumns), "%d,%d,%d,%.9g,%d,%.9g,%d,%d,%lld,%d,%d,%s,%s,%d",
+            r.width, r.height, r.threads, r.buildTime, r.buildFromCache ? 1 : 0, r.sessionTime,
+            r.framesRendered, r.rejectedFrames, (long long)r.codeSize,
+            r.vectorizedRemarks, r.missedVectorizationRemarks, hash, psnr, r.outputMismatch ? 1 : 0);
+
+        std::string ciColumns;
+        if (bootstrapResamples > 0)
+        {
+            BootstrapInterval ci = bootstrap(r.frames, bootstrapResamples, 0.95f);
+            char buf[128];
+            snprintf(buf, sizeof(buf), "%.9g,%.9g,%.9g,%.9g,",
+                ci.meanLow, ci.meanHigh, ci.medianLow, ci.medianHigh);
+            ciColumns = buf;
+        }
+
+        for (size_t j = 0; j < r.frames.size(); ++j)
+        {
+            fprintf(f, "%s,%d,%s,%s,%s,%s,%s%d,%.9g",
+                hostColumns.c_str(), (int)i, escapeCSV(r.shaderPath).c_str(),
+                escapeCSV(r.config).c_str(), escapeCSV(r.host).c_str(), runColumns,
+                ciColumns.c_str(), (int)j, r.frames[j]);
+            for (const std::string& name: counterNames)
+            {
+                auto it = r.counters.find(name);
+                if (it != r.counters.end() && j < it->second.size())
+                    fprintf(f, ",%.9g", it->second[j]);
+                else
+                    fprintf(f, ",");
+            }
+            fprintf(f, "\n");
+        }
+    }
+    fclose(f);
+}
+
+// Runs are sent from distributed benchmark workers as one line of
+// whitespace separated tokens. Strings are percent-encoded with a leading '='
+// so that empty ones are still a token.
+std::string encodeToken(const std::string& str)
+{
+    std::string out = "=";
+    for (char c: str)
+    {
+        if ((unsigned char)c <= ' ' || c == '%' || c == 0x7F)
+        {
+            char buf[4];
+            snprintf(buf, sizeof(buf), "%%%02x", (unsigned char)c);
+            out += buf;
+        }
+        else out += c;
+    }
+    return out;
+}
+
+std::string decodeToken(const std::string& token)
+{
+    std::string out;
+    for (size_t i = 1; i < token.size(); ++i)
+    {
+        if (token[i] == '%' && i + 2 < token.size())
+        {
+            out += (char)strtol(token.substr(i + 1, 2).c_str(), nullptr, 16);
+            i += 2;
+        }
+        else out += token[i];
+    }
+    return out;
+}
+
+std::string serializeRun(const RunStats& r)
+{
+    std::ostringstream out;
+    out.precision(17);
+    out << encodeToken(r.shaderPath) << ' ' << encodeToken(r.config) << ' ' <<
+        encodeToken(r.host) << ' ' << encodeToken(r.hostInfo.cpuModel) << ' ' <<
+        r.hostInfo.logicalCores << ' ' << encodeToken(r.hostInfo.platform) << ' ' <<
+        encodeToken(r.hostInfo.slangVersion) << ' ' << encodeToken(r.hostInfo.llvmVersion) << ' ' <<
+        encodeToken(r.remarks) << ' ' <<
+        r.codeSize << ' ' << r.vectorizedRemarks << ' ' << r.missedVectorizationRemarks << ' ' <<
+        r.width << ' ' << r.height << ' ' << r.buildTime << ' ' << r.buildFromCache << ' ' <<
+        r.sessionTime << ' ' << r.threads << ' ' << r.framesRendered << ' ' <<
+        r.rejectedFrames << ' ' << r.framesPerSample << ' ' << r.psnr << ' ' << r.outputMismatch;
+
+    out << ' ' << r.frames.size();
+    for (float frame: r.frames)
+        out << ' ' << frame;
+    out << ' ' << r.counters.size();
+    for (const auto& [name, values]: r.counters)
+    {
+        out << ' ' << encodeToken(name) << ' ' << values.size();
+        for (float value: values)
+            out << ' ' << value;
+    }
+    out << ' ' << r.frameHashes.size();
+    for (uint64_t hash: r.frameHashes)
+        out << ' ' << hash;
+    return out.str();
+}
+
+// False if the line is cut short or has garbage in it.
+bool deserializeRun(const std::string& line, RunStats& r)
+{
+    std::istringstream input(line);
+    bool ok = true;
+    auto text = [&]() {
+        std::string token;
+        if (!(input >> token) || token[0] != '=')
+            ok = false;
+        return ok ? decodeToken(token) : std::string();
+    };
+    // Through strtod, streams don't read back nan and inf.
+    auto number = [&]() {
+        std::string token;
+        char* end = nullptr;
+        double value = 0.0;
+        if (input >> token)
+            value = strtod(token.c_str(), &end);
+        if (!end || *end != 0)
+            ok = false;
+        return value;
+    };
+    auto count = [&]() {
+        double value = number();
+        if (value < 0 || value != floor(value) || value > line.size())
+            ok = false;
+        return ok ? size_t(value) : 0;
+    };
+
+    r.shaderPath = text();
+    r.config = text();
+    r.host = text();
+    r.hostInfo.cpuModel = text();
+    r.hostInfo.logicalCores = number();
+    r.hostInfo.platform = text();
+    r.hostInfo.slangVersion = text();
+    r.hostInfo.llvmVersion = text();
+    r.remarks = text();
+    r.codeSize = number();
+    r.vectorizedRemarks = number();
+    r.missedVectorizationRemarks = number();
+    r.width = number();
+    r.height = number();
+    r.buildTime = number();
+    r.buildFromCache = number() != 0;
+    r.sessionTime = number();
+    r.threads = number();
+    r.framesRendered = number();
+    r.rejectedFrames = number();
+    r.framesPerSample = number();
+    r.psnr = number();
+    r.outputMismatch = number() != 0;
+
+    r.frames.resize(count());
+    for (float& frame: r.frames)
+        frame = number();
+    size_t counterCount = count();
+    for (size_t i = 0; i < counterCount && ok; ++i)
+    {
+        std::vector<float>& values = r.counters[text()];
+        values.resize(count());
+        for (float& value: values)
+            value = number();
+    }
+    r.frameHashes.resize(count());
+    for (uint64_t& hash: r.frameHashes)
+    {
+        std::string token;
+        char* end = nullptr;
+        if (input >> token)
+            hash = strtoull(token.c_str(), &end, 10);
+        if (!end || *end != 0)
+            ok = false;
+    }
+    return ok;
+}
+
+// 'print' text split into literal text and ${...} variables.
+struct PrintSegment
+{
+    std::string text;
+    bool isStat = false;
+    StatSpec stat;
+};
+
+std::vector<PrintSegment> compilePrint(const char* cmd)
+{
+    std::vector<PrintSegment> segments;
+    PrintSegment literal;
+
+    while (*cmd != 0)
+    {
+        if (cmd[0] == '$' && cmd[1] == '{')
+        {
+            std::string spec;
+            cmd += 2;
+            while (*cmd && *cmd != '}')
+            {
+                spec += *cmd;
+                cmd++;
+            }
+
+            if (*cmd == '}')
+                cmd++;
+
+            if (literal.text.size() != 0)
+                segments.push_back(std::move(literal));
+            literal = PrintSegment();
+
+            PrintSegment stat;
+            stat.isStat = true;
+            stat.stat = compileStatSpec(spec);
+            segments.push_back(std::move(stat));
+        }
+        else
+        {
+            literal.text.push_back(*cmd);
+            cmd++;
+        }
+    }
+
+    if (literal.text.size() != 0)
+        segments.push_back(std::move(literal));
+    return segments;
+}
+
+struct BenchmarkCommand
+{
+    std::string op;
+    std::vector<std::string> args;
+    // Everything after the operation, 'print' needs it verbatim.
+    std::string text;
+    // Only for 'print'.
+    std::vector<PrintSegment> print;
+};
+
+std::vector<BenchmarkCommand> parseCommandList(const char* commandListPath)
+{
+    std::vector<BenchmarkCommand> commands;
+
+    std::string commandList = readTextFile(commandListPath);
+    std::istringstream input(commandList);
+
+    for (std::string command; std::getline(input, command);)
+    {
+        // Strip whitespace from command
+        const char* cmd = command.c_str();
+        skipWhitespace(cmd);
+
+        // Skip comments
+        if (*cmd == '#' || !*cmd)
+            continue;
+
+        BenchmarkCommand c;
+
+        // Read operation
+        c.op = readUntilWhitespace(cmd);
+
+        // Skip first space after command, this is important for 'print'.
+        if (*cmd) cmd++;
+
+        c.text = cmd;
+        c.args = splitByWhitespace(cmd);
+        if (c.op == "print")
+            c.print = compilePrint(cmd);
+        commands.push_back(std::move(c));
+    }
+    return commands;
+}
+
+std::string openCacheDir(const std::string& arg)
+{
+    if (arg == "off" || arg == "false")
+        return "";
+
+    std::error_code ec;
+    std::filesystem::create_directories(arg, ec);
+    if (ec)
+        panic("Unable to create cache directory %s\n", arg.c_str());
+    return arg;
+}
+
+// The rest of the line after the first skipArgs arguments, with surrounding
+// quotes removed.
+std::string getCommandRest(const BenchmarkCommand& c, int skipArgs)
+{
+    const char* rest = c.text.c_str();
+    for (int i = 0; i < skipArgs; ++i)
+    {
+        readUntilWhitespace(rest);
+        skipWhitespace(rest);
+    }
+    std::string value = rest;
+    while (value.size() != 0 && strchr(" \t\r", value.back()))
+        value.pop_back();
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+        value = value.substr(1, value.size() - 2);
+    return value;
+}
+
+// 'option <name> <value>'. The value of downstream is the rest of the line,
+// so that it can contain several arguments.
+bool parseShaderOptionCommand(const BenchmarkCommand& c, ShaderOptions& options)
+{
+    if (c.args.size() < 2)
+        return false;
+
+    std::string value = c.args[1];
+    if (c.args[0] == "downstream")
+        value = getCommandRest(c, 1);
+    else if (c.args.size() != 2)
+        return false;
+
+    return setShaderOption(options, c.args[0], value);
+}
+
+bool parseTileSize(const std::vector<std::string>& args, ShaderOptions& options)
+{
+    double w, h;
+    if (args.size() != 2 || !readDouble(args[0], w) || !readDouble(args[1], h))
+        return false;
+    if (w < 1 || h < 1 || w * h > MAX_TILE_THREADS)
+        return false;
+    options.tileWidth = int(w);
+    options.tileHeight = int(h);
+    return true;
+}
+
+struct PrebuiltShader
+{
+    bool ok = false;
+    float buildTime = 0.0f;
+    CompiledShader shader;
+};
+
+struct PrebuiltShaders
+{
+    // Kept alive until the shaders built with them are no longer needed.
+    std::vector<std::unique_ptr<ShaderCompiler>> compilers;
+    // Indexed by the 'run' command they were built for.
+    std::map<size_t, PrebuiltShader> shaders;
+};
+
+// Builds the shaders of all 'run' commands that come after 'prebuild on'
+// concurrently, instead of one at a time when each 'run' is reached.
+float prebuildShaders(const std::vector<BenchmarkCommand>& commands, const ShaderOptions& initialOptions, PrebuiltShaders& prebuilt)
+{
+    struct Job
+    {
+        size_t commandIndex;
+        std::string cacheDir;
+        ShaderOptions options;
+    };
+    std::vector<Job> jobs;
+
+    // Only the commands that affect building matter here, the rest are
+    // validated when they're actually run.
+    bool enabled = false;
+    std::string cacheDir;
+    ShaderOptions options = initialOptions;
+    for (size_t i = 0; i < commands.size(); ++i)
+    {
+        const BenchmarkCommand& c = commands[i];
+
+        if (c.op == "prebuild" && c.args.size() == 1)
+            enabled = c.args[0] == "on" || c.args[0] == "true";
+        else if (c.op == "cache" && c.args.size() == 1)
+            cacheDir = openCacheDir(c.args[0]);
+        else if (c.op == "tilesize")
+            parseTileSize(c.args, options);
+        else if (c.op == "option")
+            parseShaderOptionCommand(c, options);
+        // Multi-pass shaders are built when they're run.
+        else if (c.op == "run" && c.args.size() >= 2 && enabled && !isPathToPasses(c.args[0].c_str()))
+            jobs.push_back({i, cacheDir, options});
+    }
+
+    if (jobs.size() == 0)
+        return 0.0f;
+
+    for (const Job& job: jobs)
+        prebuilt.shaders[job.commandIndex];
+
+    int threadCount = std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min(threadCount, (int)jobs.size());
+    for (int i = 0; i < threadCount; ++i)
+        prebuilt.compilers.emplace_back(new ShaderCompiler);
+
+    uint64_t startTicks = SDL_GetTicksNS();
+
+    std::atomic<size_t> nextJob = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back([&, i](){
+            pinCurrentThread(-1);
+            ShaderCompiler& compiler = *prebuilt.compilers[i];
+
+            for (size_t j = nextJob++; j < jobs.size(); j = nextJob++)
+            {
+                const std::string& path = commands[jobs[j].commandIndex].args[0];
+                // The map isn't modified anymore, so this is safe.
+                PrebuiltShader& p = prebuilt.shaders.at(jobs[j].commandIndex);
+                std::string shaderSource;
+                if (!tryReadTextFile(path.c_str(), shaderSource))
+                {
+                    fprintf(stderr, "Unable to read %s\n", path.c_str());
+                    p.ok = false;
+                    continue;
+                }
+
+                compiler.cacheDir = jobs[j].cacheDir;
+                uint64_t buildStartTicks = SDL_GetTicksNS();
+                p.ok = compileShader(
+                    compiler, shaderSource.c_str(), isPathToGLSL(path.c_str()),
+                    jobs[j].options, p.shader);
+                uint64_t buildFinishTicks = SDL_GetTicksNS();
+                p.buildTime = (buildFinishTicks-buildStartTicks) * 1e-9;
+            }
+        });
+    }
+
+    for (std::thread& t: threads)
+        t.join();
+
+    return (SDL_GetTicksNS() - startTicks) * 1e-9;
+}
+
+int countLinesContaining(const std::string& text, std::initializer_list<const char*> needles)
+{
+    int count = 0;
+    std::istringstream input(text);
+    for (std::string line; std::getline(input, line);)
+    {
+        for (const char* needle: needles)
+        {
+            if (line.find(needle) != std::string::npos)
+            {
+                count++;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+void loadBenchmarkShader(ViewerResources& res, Stats& stats, RunStats& run, const char* shaderPath, PrebuiltShader* prebuilt)
+{
+    run.shaderPath = shaderPath;
+    run.host = getHostName();
+    run.hostInfo = getHostInfo(res);
+    if (prebuilt)
+    {
+        if (!prebuilt->ok)
+            panic("Failed to load shader %s\n", shaderPath);
+        res.shader = std::move(prebuilt->shader);
+        setMultipass(res, nullptr);
+        run.buildTime = prebuilt->buildTime;
+    }
+    else
+    {
+        uint64_t buildStartTicks = SDL_GetTicksNS();
+        if (!loadShaderFile(res, shaderPath))
+            panic("Failed to load shader %s\n", shaderPath);
+        uint64_t buildFinishTicks = SDL_GetTicksNS();
+        run.buildTime = (buildFinishTicks-buildStartTicks) * 1e-9;
+        stats.buildWallclock += run.buildTime;
+    }
+    if (stats.firstBuildTime < 0.0f)
+        stats.firstBuildTime = run.buildTime;
+    if (stats.globalSessionTime < 0.0f)
+        stats.globalSessionTime = res.compiler.globalSessionTime;
+    run.buildFromCache = res.shader.fromCache;
+    run.sessionTime = res.shader.sessionTime;
+    run.config = describeShaderOptions(res.shaderOptions);
+    run.codeSize = res.shader.codeSize;
+    run.remarks = res.shader.remarks;
+    run.vectorizedRemarks = countLinesContaining(run.remarks, {"vectorized loop", "SLP vectorized", "Vectorized horizontal reduction"});
+    run.missedVectorizationRemarks = countLinesContaining(run.remarks, {"not vectorized"});
+}
+
+static constexpr int UNTIL_CV_MAX_FACTOR = 100;
+
+struct RunOptions
+{
+    // With untilCV, this is the size of the rolling window instead.
+    int frames = 0;
+    int warmup = 0;
+    // Keeps rendering until the coefficient of variation of the last 'frames'
+    // frame times is at most this, if positive.
+    double untilCV = 0.0;
+    // Upper limit on recorded frames for untilCV, unused without it. The run
+    // command defaults it to UNTIL_CV_MAX_FACTOR times frames, so that a
+    // target that's never met can't keep going forever.
+    int maxFrames = 0;
+    // Frame times further than this many (scaled) median absolute deviations
+    // from the median are dropped, if positive.
+    double rejectOutliers = 0.0;
+};
+
+// Drops outliers based on the median absolute deviation, returns how many
+// were dropped. Values of the counters and per-frame hashes of the dropped
+// frames go too.
+int rejectOutliers(RunStats& run, double k)
+{
+    std::vector<float>& frames = run.frames;
+    if (frames.size() < 3)
+        return 0;
+
+    std::vector<float> sorted = frames;
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size()/2, sorted.end());
+    float med = sorted[sorted.size()/2];
+
+    for (float& f: sorted)
+        f = fabs(f - med);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size()/2, sorted.end());
+    // Scaled so that it estimates the standard deviation for normal noise.
+    double limit = k * 1.4826 * sorted[sorted.size()/2];
+    // More than half of the frames took exactly the median time, e.g. with a
+    // coarse timer. Everything else would be rejected, so keep them all.
+    if (limit <= 0)
+        return 0;
+
+    std::vector<bool> keep(frames.size());
+    for (size_t i = 0; i < frames.size(); ++i)
+        keep[i] = fabs(frames[i] - med) <= limit;
+
+    auto filter = [&](auto& values) {
+        if (values.size() != keep.size())
+            return;
+        size_t kept = 0;
+        for (size_t i = 0; i < values.size(); ++i)
+            if (keep[i])
+                values[kept++] = values[i];
+        values.resize(kept);
+    };
+
+    size_t before = frames.size();
+    for (auto& [name, values]: run.counters)
+        filter(values);
+    filter(run.frameHashes);
+    filter(frames);
+    return before - frames.size();
+}
+
+inline uint32_t rotateLeft(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+// xxHash32 style rounds on 8 independent lanes, which compilers keep in one
+// AVX2 register. FNV would go a byte at a time.
+uint64_t hashPixels(const uint32_t* pixels, size_t count, uint64_t seed)
+{
+    uint32_t lanes[8];
+    for (int j = 0; j < 8; ++j)
+        lanes[j] = uint32_t(seed) + j * 0x9e3779b1u;
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        for (int j = 0; j < 8; ++j)
+            lanes[j] = rotateLeft(lanes[j] + pixels[i + j] * 0x85ebca77u, 13) * 0x9e3779b1u;
+
+    uint64_t hash = hashBytes(seed ^ count, lanes, sizeof(lanes));
+    hash = hashBytes(hash, pixels + i, (count - i) * sizeof(uint32_t));
+    // Final mix from MurmurHash3, FNV leaves the high bits weak.
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Rows are hashed separately and then together, so the result doesn't depend
+// on the thread count, the pitch or the layout. It does depend on the pixel
+// format.
+uint64_t hashFramebuffer(ViewerResources& res, const uint32_t* pixels, int width, int height, int pitch, bool tiled, bool multithreaded)
+{
+    std::vector<uint64_t> rowHashes(height);
+    #pragma omp parallel for schedule(static) num_threads(multithreaded ? getThreadCount(res) : 1)
+    for (int y = 0; y < height; ++y)
+    {
+        if (tiled)
+        {
+            thread_local std::vector<uint32_t> row;
+            row.resize(width);
+            detileRows(pixels, pitch, width, y, 1, row.data(), width);
+            rowHashes[y] = hashPixels(row.data(), width, y);
+        }
+        else
+            rowHashes[y] = hashPixels(pixels + size_t(y) * pitch, width, y);
+    }
+    return hashBytes(HASH_SEED, rowHashes.data(), rowHashes.size() * sizeof(uint64_t));
+}
+
+// Of the RGB channels of two ABGR8888 images, alpha is ignored.
+double computePSNR(const uint32_t* a, int aPitch, const uint32_t* b, int bPitch, int width, int height)
+{
+    double squareSum = 0.0;
+    #pragma omp parallel for reduction(+:squareSum)
+    for (int y = 0; y < height; ++y)
+    {
+        int64_t rowSum = 0;
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t pa = a[x + size_t(y) * aPitch];
+            uint32_t pb = b[x + size_t(y) * bPitch];
+            for (int shift = 0; shift < 24; shift += 8)
+            {
+                int d = int((pa >> shift) & 0xFF) - int((pb >> shift) & 0xFF);
+                rowSum += d * d;
+            }
+        }
+        squareSum += rowSum;
+    }
+
+    double mse = squareSum / (3.0 * width * height);
+    return mse == 0.0 ? INFINITY : 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+void saveImageBMP(const char* path, uint32_t* pixels, int width, int height)
+{
+    SDL_Surface* surf = SDL_CreateSurfaceFrom(width, height, SDL_PIXELFORMAT_ABGR8888, pixels, width * 4);
+    if (!surf || !SDL_SaveBMP(surf, path))
+        panic("Unable to write %s: %s\n", path, SDL_GetError());
+    SDL_DestroySurface(surf);
+}
+
+// Hashes, dumps and compares the final frame of a run, as configured.
+// Nothing here is part of the frame times.
+void checkFinalFrame(ViewerResources& res, RunStats& run, const uint32_t* pixels, int pitch, bool multithreaded)
+{
+    OutputCheck& check = res.outputCheck;
+    if (check.capture != FrameCapture::OFF)
+    {
+        if (check.capture == FrameCapture::FINAL)
+            run.frameHashes.push_back(hashFramebuffer(res, pixels, run.width, run.height, pitch, res.shader.tiledFramebuffer, multithreaded));
+        printf("%s: final frame hash %016llx\n", run.shaderPath.c_str(), (unsigned long long)run.frameHashes.back());
+    }
+
+    if (check.dumpDir.empty() && check.goldenPath.empty())
+        return;
+
+    // Images are always ABGR8888, whatever the shader packed its pixels as.
+    std::vector<uint32_t> image(size_t(run.width) * run.height);
+    if (res.shader.tiledFramebuffer)
+    {
+        detileRows(pixels, pitch, run.width, 0, run.height, image.data(), run.width);
+        SDL_ConvertPixels(
+            run.width, run.height, res.shader.pixelFormat, image.data(), run.width * 4,
+            SDL_PIXELFORMAT_ABGR8888, image.data(), run.width * 4);
+    }
+    else
+    {
+        SDL_ConvertPixels(
+            run.width, run.height, res.shader.pixelFormat, pixels, pitch * 4,
+            SDL_PIXELFORMAT_ABGR8888, image.data(), run.width * 4);
+    }
+
+    if (!check.dumpDir.empty())
+    {
+        std::string name = std::filesystem::path(run.shaderPath).stem().string() +
+            "-" + std::to_string(check.dumpCount++) + ".bmp";
+        saveImageBMP((std::filesystem::path(check.dumpDir) / name).string().c_str(), image.data(), run.width, run.height);
+    }
+
+    if (check.goldenPath.empty())
+        return;
+
+    std::error_code ec;
+    if (!std::filesystem::exists(check.goldenPath, ec) && !ec)
+    {
+        // Whatever runs first becomes the reference. Written to a temporary
+        // file first, distributed workers may be writing it at the same time
+        // and nobody should read a partial image.
+        std::string tmpPath = check.goldenPath + "." + getHostName() + "." +
+            std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        saveImageBMP(tmpPath.c_str(), image.data(), run.width, run.height);
+        std::filesystem::rename(tmpPath, check.goldenPath, ec);
+        if (ec)
+            panic("Unable to write %s\n", check.goldenPath.c_str());
+        printf("%s: wrote golden image %s\n", run.shaderPath.c_str(), check.goldenPath.c_str());
+        return;
+    }
+
+    // Anything wrong with an existing reference is an error, not a reason
+    // to replace it.
+    SDL_Surface* loaded = SDL_LoadBMP(check.goldenPath.c_str());
+    if (!loaded)
+        panic("Unable to load golden image %s: %s\n", check.goldenPath.c_str(), SDL_GetError());
+    SDL_Surface* golden = SDL_ConvertSurface(loaded, SDL_PIXELFORMAT_ABGR8888);
+    SDL_DestroySurface(loaded);
+    if (!golden)
+        panic("Unable to convert %s: %s\n", check.goldenPath.c_str(), SDL_GetError());
+
+    if (golden->w != run.width || golden->h != run.height)
+    {
+        printf(
+            "%s: golden image %s is %dx%d, but the run is %dx%d\n",
+            run.shaderPath.c_str(), check.goldenPath.c_str(), golden->w, golden->h, run.width, run.height);
+        run.psnr = 0.0;
+    }
+    else
+    {
+        run.psnr = computePSNR(
+            image.data(), run.width, (const uint32_t*)golden->pixels, golden->pitch / 4,
+            run.width, run.height);
+    }
+    SDL_DestroySurface(golden);
+
+    run.outputMismatch = run.psnr < check.minPSNR;
+    if (run.outputMismatch)
+    {
+        check.mismatches++;
+        printf(
+            "%s: OUTPUT MISMATCH, PSNR %.2f dB against %s is below %.2f dB\n",
+            run.shaderPath.c_str(), run.psnr, check.goldenPath.c_str(), check.minPSNR);
+    }
+}
+
+void renderBenchmarkFrames(ViewerResources& res, RunStats& run, const RunOptions& opts, double forcedDeltaTime, bool multithreaded)
+{
+    run.threads = multithreaded ? getThreadCount(res) : 1;
+    run.width = res.width;
+    run.height = res.height;
+
+    auto& params = *res.constants;
+    params.frame = 0;
+    params.mouseX = 0;
+    params.mouseY = 0;
+    params.mouseClickX = 0;
+    params.mouseClickY = 0;
+
+    // Rendered straight into the window surface when possible, which is
+    // locked for each frame separately.
+    bool direct = canRenderToSurface(res) && res.surf->w == res.width && res.surf->h == res.height;
+    // Tiled framebuffers are never direct, and padded to whole tiles.
+    bool tiled = res.shader.tiledFramebuffer;
+    int pitch = direct ? res.surf->pitch / 4 : tiled ? getTiledPitch(res.width) : res.width;
+
+    // Left uninitialized so that firstTouchTile() gets to touch it first.
+    size_t framebufferSize = tiled ? getTiledTexelCount(res.width, res.height) : size_t(pitch) * res.height;
+    std::unique_ptr<uint32_t[]> framebuffer;
+    std::vector<uint32_t*> framebuffers;
+    if (direct)
+    {
+        // SDL owns that memory, first touch doesn't apply.
+    }
+    else if (res.presenter)
+    {
+        drainFramePresenter(res, framebufferSize);
+        for (auto& buffer: res.presenter->buffers)
+            framebuffers.push_back(buffer.get());
+    }
+    else
+    {
+        framebuffer.reset(new uint32_t[framebufferSize]);
+        framebuffers.push_back(framebuffer.get());
+    }
+
+    res.globalParams.pixelDataSize = framebufferSize;
+    params.pitch = pitch;
+    params.resX = res.width;
+    params.resY = res.height;
+    params.resZ = 1;
+
+    for (uint32_t* buffer: framebuffers)
+    {
+        res.globalParams.pixelData = buffer;
+        if (multithreaded)
+            renderFrameMultithread(res, res.width, res.height, firstTouchTile);
+        else
+            renderFrameSinglethread(res, res.width, res.height, firstTouchTile);
+    }
+    res.globalParams.pixelData = direct ? nullptr : framebuffers[0];
+
+    if (res.tileTiming.enabled)
+        resetTileTiming(res, res.width, res.height);
+    TileFunc tileFunc = getTileFunc(res);
+
+    PerfCounters& perf = res.perfCounters;
+    std::vector<double> perfStart, perfEnd;
+    std::vector<std::vector<float>> perfFrames(perf.descs.size());
+    if (perf.enabled)
+        openPerfCounters(perf, getRenderThreadIds(res, multithreaded));
+
+    uint64_t startTicks = SDL_GetTicksNS();
+    uint64_t cumulatedTicks = 0;
+
+    // Running sums over the rolling window of untilCV.
+    double windowSum = 0.0;
+    double windowSquareSum = 0.0;
+
+    // Still intact after the loop, nothing renders into it anymore.
+    const uint32_t* lastPixels = nullptr;
+
+    // Buffer passes have to see each frame finish, and timed tiles and
+    // per-frame hashes need every frame on its own.
+    int batchSize = res.frameBatch;
+    if (res.multipass || res.tileTiming.enabled || res.outputCheck.capture == FrameCapture::EVERY)
+        batchSize = 1;
+    if (batchSize > 1)
+        run.config += " batch=" + std::to_string(batchSize);
+    // Only whole batches are recorded, so frames is rounded up to them.
+    run.framesPerSample = batchSize;
+    size_t windowSamples = (opts.frames + batchSize - 1) / batchSize;
+    std::vector<ShaderViewerConstants> batchConstants(batchSize);
+    std::vector<RunnerGlobalParams> batchParams(batchSize);
+    int batch = 1;
+
+    for (;; params.frame += batch)
+    {
+        int recorded = params.frame - opts.warmup;
+        if (recorded >= opts.frames)
+        {
+            if (opts.untilCV <= 0.0 || windowSamples < 2)
+                break;
+
+            double n = windowSamples;
+            double mean = windowSum / n;
+            double variance = std::max(windowSquareSum / n - mean * mean, 0.0);
+            if (sqrt(variance) <= opts.untilCV * mean)
+                break;
+        }
+        if (opts.untilCV > 0.0 && opts.maxFrames > 0 && recorded >= opts.maxFrames)
+        {
+            printf("%s: until-cv %g not reached in %d frames\n", run.shaderPath.c_str(), opts.untilCV, opts.maxFrames);
+            break;
+        }
+
+        uint64_t curTicks = SDL_GetTicksNS();
+        uint64_t deltaTicks = curTicks - startTicks;
+        if (forcedDeltaTime > 0)
+            deltaTicks = round(forcedDeltaTime * 1e9) * batch;
+
+        if (params.frame != 0)
+            cumulatedTicks += deltaTicks;
+
+        startTicks = curTicks;
+        params.time = cumulatedTicks * 1e-9;
+
+        // Frames of a batch are spaced like the frames of the previous one.
+        // Batches don't cross from warmup to recorded frames.
+        double batchDeltaTime = deltaTicks * 1e-9 / batch;
+        batch = batchSize;
+        if (recorded < 0)
+            batch = std::min(batch, -recorded);
+        for (int i = 0; i < batch && batch > 1; ++i)
+        {
+            batchConstants[i] = params;
+            batchConstants[i].frame = params.frame + i;
+            batchConstants[i].time = params.time + i * batchDeltaTime;
+        }
+
+        // Avoid getting the "program is unresponsive" message.
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            switch (event.type)
+            {
+            case SDL_EVENT_QUIT:
+                panic("User interrupted benchmark.");
+                break;
+            }
+        }
+
+        // Waiting for a free framebuffer isn't part of the frame time.
+        if (direct)
+        {
+            SDL_LockSurface(res.surf);
+            res.globalParams.pixelData = (uint32_t*)res.surf->pixels;
+        }
+        else if (res.presenter)
+            res.globalParams.pixelData = acquireFramebuffer(res, framebufferSize);
+        for (int i = 0; i < batch && batch > 1; ++i)
+        {
+            batchParams[i] = res.globalParams;
+            batchParams[i].constants = &batchConstants[i];
+        }
+
+        if (perf.enabled)
+            readPerfCounters(perf, perfStart);
+
+        uint64_t renderStartTicks = SDL_GetTicksNS();
+        if (res.multipass)
+            renderBufferPasses(res, res.width, res.height, multithreaded);
+        if (batch > 1)
+            renderFrameBatch(res, res.width, res.height, batchParams.data(), batch, multithreaded);
+        else if (multithreaded)
+            renderFrameMultithread(res, res.width, res.height, tileFunc);
+        else
+            renderFrameSinglethread(res, res.width, res.height, tileFunc);
+        uint64_t renderFinishTicks = SDL_GetTicksNS();
+        res.tileTiming.frames++;
+
+        // A batch is one sample of its mean frame time and counters.
+        if (perf.enabled)
+        {
+            readPerfCounters(perf, perfEnd);
+            if (recorded >= 0)
+            {
+                for (size_t i = 0; i < perf.descs.size(); ++i)
+                    perfFrames[i].push_back((perfEnd[i] - perfStart[i]) / batch);
+            }
+        }
+
+        lastPixels = res.globalParams.pixelData;
+        if (res.outputCheck.capture == FrameCapture::EVERY && recorded >= 0)
+        {
+            run.frameHashes.push_back(
+                hashFramebuffer(res, lastPixels, res.width, res.height, pitch, tiled, multithreaded));
+        }
+
+        float frameTime = (renderFinishTicks - renderStartTicks) * 1e-9 / batch;
+        if (recorded >= 0)
+        {
+            run.frames.push_back(frameTime);
+            windowSum += frameTime;
+            windowSquareSum += double(frameTime) * frameTime;
+            if (run.frames.size() > windowSamples)
+            {
+                float oldest = run.frames[run.frames.size() - windowSamples - 1];
+                windowSum -= oldest;
+                windowSquareSum -= double(oldest) * oldest;
+            }
+        }
+
+        if (direct)
+        {
+            SDL_UnlockSurface(res.surf);
+            SDL_UpdateWindowSurface(res.window);
+        }
+        else if (res.presenter)
+            submitFramebuffer(res);
+        else
+            presentFramebuffer(res, framebuffer.get());
+    }
+
+    run.framesRendered = params.frame;
+
+    // Nothing may be left converting once the run is over, the next command
+    // could resize the window.
+    if (res.presenter)
+        drainFramePresenter(res, 0);
+
+    const OutputCheck& check = res.outputCheck;
+    if (lastPixels && (check.capture != FrameCapture::OFF || !check.dumpDir.empty() || !check.goldenPath.empty()))
+    {
+        if (direct)
+            SDL_LockSurface(res.surf);
+        checkFinalFrame(res, run, direct ? (const uint32_t*)res.surf->pixels : lastPixels, pitch, multithreaded);
+        if (direct)
+            SDL_UnlockSurface(res.surf);
+    }
+
+    if (perf.enabled)
+    {
+        closePerfCounters(perf);
+        for (size_t i = 0; i < perf.descs.size(); ++i)
+            run.counters[perf.descs[i].name] = std::move(perfFrames[i]);
+
+        auto cycles = run.counters.find("cycles");
+        auto instructions = run.counters.find("instructions");
+        if (cycles != run.counters.end() && instructions != run.counters.end())
+        {
+            std::vector<float>& ipc = run.counters["ipc"];
+            for (size_t i = 0; i < cycles->second.size(); ++i)
+                ipc.push_back(cycles->second[i] > 0 ? instructions->second[i] / cycles->second[i] : 0.0f);
+        }
+    }
+
+    // Only the window that met the target counts.
+    if (opts.untilCV > 0.0 && run.frames.size() > windowSamples)
+    {
+        run.frames.erase(run.frames.begin(), run.frames.end() - windowSamples);
+        for (auto& [name, values]: run.counters)
+            values.erase(values.begin(), values.end() - windowSamples);
+        if (run.frameHashes.size() > windowSamples)
+            run.frameHashes.erase(run.frameHashes.begin(), run.frameHashes.end() - windowSamples);
+    }
+
+    run.rejectedFrames = 0;
+    if (opts.rejectOutliers > 0.0)
+        run.rejectedFrames = rejectOutliers(run, opts.rejectOutliers);
+}
+
+void benchmarkRenderMain(ViewerResources& res, Stats& stats, const char* shaderPath, PrebuiltShader* prebuilt, const RunOptions& opts, double forcedDeltaTime, bool multithreaded)
+{
+    RunStats run;
+    loadBenchmarkShader(res, stats, run, shaderPath, prebuilt);
+    renderBenchmarkFrames(res, run, opts, forcedDeltaTime, multithreaded);
+    stats.runs.emplace_back(run);
+}
+
+// Runs the same shader with 1 to maxThreads threads, and reports how well it
+// scales compared to the single-threaded run.
+void benchmarkScalingMain(ViewerResources& res, Stats& stats, const char* shaderPath, int frameCount, int maxThreads, double forcedDeltaTime)
+{
+    RunStats buildRun;
+    loadBenchmarkShader(res, stats, buildRun, shaderPath, nullptr);
+
+    int savedThreadCount = res.threadCount;
+    float singleThreadTime = 0.0f;
+    for (int threads = 1; threads <= maxThreads; ++threads)
+    {
+        res.threadCount = threads;
+        applyThreadConfig(res);
+
+        RunStats run = buildRun;
+        RunOptions opts;
+        opts.frames = frameCount;
+        renderBenchmarkFrames(res, run, opts, forcedDeltaTime, true);
+
+        float frameTime = median(run.frames);
+        if (threads == 1)
+            singleThreadTime = frameTime;
+
+        printf(
+            "%s: %d threads, median frame-time %f, speedup %f, efficiency %f\n",
+            shaderPath, threads, frameTime,
+            singleThreadTime / frameTime,
+            singleThreadTime / (frameTime * threads));
+
+        stats.runs.emplace_back(run);
+    }
+
+    res.threadCount = savedThreadCount;
+    applyThreadConfig(res);
+}
+
+struct SweepAxis
+{
+    std::string option;
+    std::vector<std::string> values;
+};
+
+// Builds and runs the shader with every combination of the option values,
+// restoring the options afterwards.
+void benchmarkSweepMain(ViewerResources& res, Stats& stats, const char* shaderPath, int frameCount, const std::vector<SweepAxis>& axes, double forcedDeltaTime, bool multithreaded)
+{
+    ShaderOptions savedOptions = res.shaderOptions;
+    std::vector<size_t> indices(axes.size(), 0);
+
+    for (;;)
+    {
+        res.shaderOptions = savedOptions;
+        for (size_t i = 0; i < axes.size(); ++i)
+            setShaderOption(res.shaderOptions, axes[i].option, axes[i].values[indices[i]]);
+
+        RunStats run;
+        loadBenchmarkShader(res, stats, run, shaderPath, nullptr);
+        RunOptions opts;
+        opts.frames = frameCount;
+        renderBenchmarkFrames(res, run, opts, forcedDeltaTime, multithreaded);
+
+        printf(
+            "%s [%s]: build-time %f, median frame-time %f\n",
+            shaderPath, run.config.c_str(), run.buildTime, median(run.frames));
+        stats.runs.emplace_back(std::move(run));
+
+        // Odometer over the axes, the last one changes fastest.
+        size_t axis = axes.size();
+        while (axis > 0 && ++indices[axis-1] == axes[axis-1].values.size())
+        {
+            indices[axis-1] = 0;
+            axis--;
+        }
+        if (axis == 0)
+            break;
+    }
+
+    res.shaderOptions = savedOptions;
+}
+
+enum class VideoFormat
+{
+    // RGBA, 8 bits per channel.
+    RAW,
+    // 4:2:0 full range BT.601. C420jpeg in the header only gives the chroma
+    // siting, XCOLORRANGE=FULL tells readers the range.
+    Y4M
+};
+
+size_t getVideoFrameSize(VideoFormat format, int width, int height)
+{
+    if (format == VideoFormat::RAW)
+        return size_t(width) * height * 4;
+    size_t chromaSize = size_t((width + 1) / 2) * ((height + 1) / 2);
+    return size_t(width) * height + 2 * chromaSize;
+}
+
+void convertVideoFrame(const uint32_t* pixels, int width, int height, const PixelPacking& packing, VideoFormat format, uint8_t* out)
+{
+    auto channels = [&](uint32_t p, int& r, int& g, int& b) {
+        r = (p >> packing.rShift) & 0xFF;
+        g = (p >> packing.gShift) & 0xFF;
+        b = (p >> packing.bShift) & 0xFF;
+    };
+
+    if (format == VideoFormat::RAW)
+    {
+        for (size_t i = 0; i < size_t(width) * height; ++i)
+        {
+            int r, g, b;
+            channels(pixels[i], r, g, b);
+            out[i*4+0] = r;
+            out[i*4+1] = g;
+            out[i*4+2] = b;
+            out[i*4+3] = (pixels[i] >> packing.aShift) & 0xFF;
+        }
+        return;
+    }
+
+    // One 2x2 block at a time, chroma is from the average of the block. On
+    // odd sizes, the last row or column is used twice, which averages the
+    // same. Coefficients are 16.16 fixed point.
+    int chromaWidth = (width + 1) / 2;
+    int chromaHeight = (height + 1) / 2;
+    uint8_t* y = out;
+    uint8_t* u = out + size_t(width) * height;
+    uint8_t* v = u + size_t(chromaWidth) * chromaHeight;
+    for (int cy = 0; cy < chromaHeight; ++cy)
+    {
+        size_t rows[2] = {size_t(cy * 2) * width, size_t(std::min(cy * 2 + 1, height - 1)) * width};
+        for (int cx = 0; cx < chromaWidth; ++cx)
+        {
+            size_t columns[2] = {size_t(cx * 2), size_t(std::min(cx * 2 + 1, width - 1))};
+            int rSum = 0, gSum = 0, bSum = 0;
+            for (size_t row: rows)
+            for (size_t column: columns)
+            {
+                int r, g, b;
+                channels(pixels[row + column], r, g, b);
+                y[row + column] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+                rSum += r;
+                gSum += g;
+                bSum += b;
+            }
+            size_t i = cx + size_t(cy) * chromaWidth;
+            u[i] = std::clamp((-11059 * rSum - 21709 * gSum + 32768 * bSum + (512 << 16) + 131072) >> 18, 0, 255);
+            v[i] = std::clamp((32768 * rSum - 27439 * gSum - 5329 * bSum + (512 << 16) + 131072) >> 18, 0, 255);
+        }
+    }
+}
+
+// Bounded by the number of buffers going around, which are only allocated
+// once. Popping waits until there's something, or fails once the queue is
+// closed and empty.
+struct FrameQueue
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<int> items;
+    bool closed = false;
+};
+
+void pushFrameQueue(FrameQueue& queue, int item)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.items.push_back(item);
+    }
+    queue.cv.notify_one();
+}
+
+void closeFrameQueue(FrameQueue& queue)
+{
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.closed = true;
+    }
+    queue.cv.notify_all();
+}
+
+bool popFrameQueue(FrameQueue& queue, int& item)
+{
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    queue.cv.wait(lock, [&]{ return queue.closed || !queue.items.empty(); });
+    if (queue.items.empty())
+        return false;
+    item = queue.items.front();
+    queue.items.pop_front();
+    return true;
+}
+
+// Rendering, conversion and writing each have their own thread, with this
+// many frames in flight between each two.
+static constexpr int VIDEO_BUFFERS = 2;
+
+// Renders frames at a fixed frame rate and streams them to a file, or to the
+// standard input of a command when outPath starts with '|'. Files ending in
+// .y4m and pipes get Y4M, anything else raw RGBA.
+void renderVideoMain(ViewerResources& res, Stats& stats, const char* shaderPath, int frameCount, const char* outPath, double forcedDeltaTime, bool multithreaded)
+{
+    RunStats run;
+    loadBenchmarkShader(res, stats, run, shaderPath, nullptr);
+    run.threads = multithreaded ? getThreadCount(res) : 1;
+    run.width = res.width;
+    run.height = res.height;
+
+    bool piped = outPath[0] == '|';
+    VideoFormat format = piped || std::filesystem::path(outPath).extension() == ".y4m" ?
+        VideoFormat::Y4M : VideoFormat::RAW;
+#ifdef _WIN32
+    FILE* out = piped ? _popen(outPath + 1, "wb") : fopen(outPath, "wb");
+#else
+    FILE* out = piped ? popen(outPath + 1, "w") : fopen(outPath, "wb");
+    // A command that exits early should fail the write, not kill us.
+    auto savedSigpipe = signal(SIGPIPE, SIG_IGN);
+#endif
+    if (!out)
+        panic("Unable to open %s\n", outPath);
+
+    double fps = forcedDeltaTime > 0 ? 1.0 / forcedDeltaTime : 60.0;
+    if (format == VideoFormat::Y4M)
+    {
+        fprintf(
+            out, "YUV4MPEG2 W%d H%d F%lld:1000 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n",
+            res.width, res.height, (long long)llround(fps * 1000.0));
+    }
+
+    PixelPacking packing;
+    getPixelPacking(res.shader.pixelFormat, packing);
+
+    bool tiled = res.shader.tiledFramebuffer;
+    int pitch = tiled ? getTiledPitch(res.width) : res.width;
+    size_t framebufferSize = tiled ? getTiledTexelCount(res.width, res.height) : size_t(res.width) * res.height;
+    size_t outputSize = getVideoFrameSize(format, res.width, res.height);
+    std::unique_ptr<uint32_t[]> framebuffers[VIDEO_BUFFERS];
+    std::unique_ptr<uint8_t[]> outputs[VIDEO_BUFFERS];
+    FrameQueue freeFramebuffers, renderedFrames, freeOutputs, convertedFrames;
+    for (int i = 0; i < VIDEO_BUFFERS; ++i)
+    {
+        framebuffers[i].reset(new uint32_t[framebufferSize]);
+        outputs[i].reset(new uint8_t[outputSize]);
+        pushFrameQueue(freeFramebuffers, i);
+        pushFrameQueue(freeOutputs, i);
+    }
+
+    // A failed write stops the other threads through the queues, and is
+    // reported once they're done.
+    std::atomic<bool> writeFailed = false;
+    int width = res.width;
+    int height = res.height;
+    std::thread converter([&](){
+        pinCurrentThread(-1);
+        // Tiled frames are detiled by the converter, off the render thread.
+        std::vector<uint32_t> linear(tiled ? size_t(width) * height : 0);
+        int framebuffer, output;
+        while (popFrameQueue(renderedFrames, framebuffer) && popFrameQueue(freeOutputs, output))
+        {
+            const uint32_t* pixels = framebuffers[framebuffer].get();
+            if (tiled)
+            {
+                detileRows(pixels, pitch, width, 0, height, linear.data(), width);
+                pixels = linear.data();
+            }
+            convertVideoFrame(pixels, width, height, packing, format, outputs[output].get());
+            pushFrameQueue(freeFramebuffers, framebuffer);
+            pushFrameQueue(convertedFrames, output);
+        }
+        closeFrameQueue(convertedFrames);
+        closeFrameQueue(freeFramebuffers);
+    });
+    std::thread writer([&](){
+        pinCurrentThread(-1);
+        int output;
+        while (popFrameQueue(convertedFrames, output))
+        {
+            if ((format == VideoFormat::Y4M && fputs("FRAME\n", out) < 0) ||
+                fwrite(outputs[output].get(), 1, outputSize, out) != outputSize)
+            {
+                writeFailed = true;
+                closeFrameQueue(freeOutputs);
+                break;
+            }
+            pushFrameQueue(freeOutputs, output);
+        }
+    });
+
+    auto& params = *res.constants;
+    params.mouseX = 0;
+    params.mouseY = 0;
+    params.mouseClickX = 0;
+    params.mouseClickY = 0;
+    params.pitch = pitch;
+    params.resX = res.width;
+    params.resY = res.height;
+    params.resZ = 1;
+    res.globalParams.pixelDataSize = framebufferSize;
+
+    uint64_t startTicks = SDL_GetTicksNS();
+    uint64_t waitTicks = 0;
+    for (params.frame = 0; params.frame < frameCount; ++params.frame)
+    {
+        params.time = params.frame / fps;
+
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            if (event.type == SDL_EVENT_QUIT)
+                panic("User interrupted rendering.");
+        }
+
+        // Only waits when conversion or writing is slower than rendering.
+        uint64_t waitStartTicks = SDL_GetTicksNS();
+        int framebuffer;
+        if (!popFrameQueue(freeFramebuffers, framebuffer))
+            break;
+        res.globalParams.pixelData = framebuffers[framebuffer].get();
+        uint64_t renderStartTicks = SDL_GetTicksNS();
+        waitTicks += renderStartTicks - waitStartTicks;
+
+        if (res.multipass)
+            renderBufferPasses(res, res.width, res.height, multithreaded);
+        if (multithreaded)
+            renderFrameMultithread(res, res.width, res.height);
+        else
+            renderFrameSinglethread(res, res.width, res.height);
+        run.frames.push_back((SDL_GetTicksNS() - renderStartTicks) * 1e-9);
+
+        pushFrameQueue(renderedFrames, framebuffer);
+    }
+    closeFrameQueue(renderedFrames);
+    converter.join();
+    writer.join();
+    res.globalParams.pixelData = nullptr;
+
+#ifdef _WIN32
+    int status = piped ? _pclose(out) : fclose(out);
+#else
+    int status = piped ? pclose(out) : fclose(out);
+    signal(SIGPIPE, savedSigpipe);
+#endif
+    if (writeFailed)
+        panic("Unable to write %s\n", outPath);
+    if (status != 0)
+        panic("Failed to finish writing %s\n", outPath);
+
+    double totalTime = (SDL_GetTicksNS() - startTicks) * 1e-9;
+    printf(
+        "%s: rendered %d frames to %s in %f s (%f fps), %f s waiting for conversion or writing\n",
+        shaderPath, frameCount, outPath, totalTime, frameCount / totalTime, waitTicks * 1e-9);
+
+    run.framesRendered = frameCount;
+    run.rejectedFrames = 0;
+    stats.runs.emplace_back(std::move(run));
+}
+
+std::vector<int> getSocketCpus(int socket)
+{
+    std::vector<int> cpus;
+    std::error_code ec;
+    for (const auto& entry: std::filesystem::directory_iterator("/sys/devices/system/cpu", ec))
+    {
+        std::string name = entry.path().filename().string();
+        if (name.size() <= 3 || name.compare(0, 3, "cpu") != 0 ||
+            !std::all_of(name.begin()+3, name.end(), ::isdigit))
+            continue;
+
+        FILE* f = fopen((entry.path() / "topology/physical_package_id").string().c_str(), "r");
+        if (!f)
+            continue;
+        int id = -1;
+        if (fscanf(f, "%d", &id) == 1 && id == socket)
+            cpus.push_back(atoi(name.c_str()+3));
+        fclose(f);
+    }
+    std::sort(cpus.begin(), cpus.end());
+    return cpus;
+}
+
+// Parses lists like "0-3,8,10-11".
+bool parseIndexList(const std::string& str, std::vector<int>& indices)
+{
+    std::istringstream input(str);
+    for (std::string part; std::getline(input, part, ',');)
+    {
+        int first, last;
+        char dash;
+        std::istringstream range(part);
+        if (!(range >> first))
+            return false;
+        last = first;
+        if (range >> dash && (dash != '-' || !(range >> last)))
+            return false;
+        if (first < 0 || last < first)
+            return false;
+        for (int i = first; i <= last; ++i)
+            indices.push_back(i);
+    }
+    return indices.size() != 0;
+}
+
+enum class BenchmarkRole
+{
+    LOCAL,
+    // Runs its share of the run commands and sends the results to stdout.
+    WORKER,
+    // Starts the workers, and handles clear, print, export and remarks over
+    // their merged results.
+    COORDINATOR
+};
+
+struct BenchmarkDistribution
+{
+    BenchmarkRole role = BenchmarkRole::LOCAL;
+    // Worker shardIndex of shardCount gets every shardCount:th command that
+    // records runs, starting from the shardIndex:th.
+    int shardIndex = 0;
+    int shardCount = 1;
+    // For the coordinator, 'local' starts a worker on this machine and
+    // anything else goes through ssh.
+    std::vector<std::string> hosts;
+    std::string executable;
+};
+
+bool isRunCommand(const std::string& op)
+{
+    return op == "run" || op == "scaling" || op == "sweep" || op == "render";
+}
+
+// Turns everything this worker shouldn't do into 'remote' commands, which do
+// nothing. Printing is left to the coordinator, and so are the per-run
+// outputs of runs that went to other workers.
+void shardCommands(std::vector<BenchmarkCommand>& commands, int shardIndex, int shardCount)
+{
+    int runCommands = 0;
+    bool ownsPreviousRun = false;
+    for (BenchmarkCommand& c: commands)
+    {
+        if (isRunCommand(c.op))
+        {
+            ownsPreviousRun = runCommands++ % shardCount == shardIndex;
+            if (!ownsPreviousRun)
+                c.op = "remote";
+        }
+        else if (c.op == "print" || c.op == "export" || c.op == "baseline" || c.op == "remarks" ||
+            (c.op == "heatmap" && !ownsPreviousRun))
+            c.op = "remote";
+    }
+}
+
+// Quoted for sh.
+std::string quoteShellArg(const std::string& arg)
+{
+    std::string out = "'";
+    for (char c: arg)
+    {
+        if (c == '\'')
+            out += "'\\''";
+        else
+            out += c;
+    }
+    return out + "'";
+}
+
+// Starts a headless worker per host and waits for all of them. Their runs are
+// keyed by the index of the command that recorded them, everything else they
+// print is passed through. False if any of them failed.
+bool runBenchmarkWorkers(
+    const char* commandListPath,
+    const BenchmarkDistribution& dist,
+    std::map<size_t, std::vector<RunStats>>& remoteRuns,
+    float& buildWallclock
+){
+    // Relative shader paths have to resolve the same way on the workers.
+    std::string cwd = std::filesystem::current_path().string();
+    std::string listPath = std::filesystem::absolute(commandListPath).string();
+
+    std::mutex mutex;
+    std::atomic<bool> ok = true;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < dist.hosts.size(); ++i)
+    {
+        const std::string& host = dist.hosts[i];
+        std::string command = "cd " + quoteShellArg(cwd) + " && " +
+            quoteShellArg(dist.executable) + " --worker " +
+            std::to_string(i) + "/" + std::to_string(dist.hosts.size()) + " " +
+            quoteShellArg(listPath);
+        if (host != "local")
+            command = "ssh " + quoteShellArg(host) + " " + quoteShellArg(command);
+
+        threads.emplace_back([&, host, command](){
+            pinCurrentThread(-1);
+            FILE* pipe = popen(command.c_str(), "r");
+            if (!pipe)
+            {
+                fprintf(stderr, "Unable to start worker on %s\n", host.c_str());
+                ok = false;
+                return;
+            }
+
+            std::string line;
+            char buf[4096];
+            while (fgets(buf, sizeof(buf), pipe))
+            {
+                line += buf;
+                if (line.back() != '\n')
+                    continue;
+                line.pop_back();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t commandIndex;
+                int length = 0;
+                float wallclock;
+                if (sscanf(line.c_str(), "@@run %zu %n", &commandIndex, &length) == 1 && length > 0)
+                {
+                    RunStats run;
+                    if (!deserializeRun(line.substr(length), run))
+                    {
+                        fprintf(stderr, "%s: malformed run from worker\n", host.c_str());
+                        ok = false;
+                    }
+                    remoteRuns[commandIndex].push_back(std::move(run));
+                }
+                else if (sscanf(line.c_str(), "@@build-wallclock %f", &wallclock) == 1)
+                    buildWallclock += wallclock;
+                else
+                    printf("[%s] %s\n", host.c_str(), line.c_str());
+                line.clear();
+            }
+
+            if (pclose(pipe) != 0)
+            {
+                fprintf(stderr, "Worker on %s failed\n", host.c_str());
+                ok = false;
+            }
+        });
+    }
+
+    for (std::thread& t: threads)
+        t.join();
+    return ok;
+}
+
+// Totals per host, so that machines that are slower than the others stand out.
+void printHostSummary(const Stats& stats)
+{
+    std::map<std::string, std::vector<const RunStats*>> hosts;
+    for (const RunStats& r: stats.runs)
+        hosts[r.host].push_back(&r);
+
+    for (const auto& [host, runs]: hosts)
+    {
+        size_t frames = 0;
+        double logSum = 0.0;
+        int medians = 0;
+        for (const RunStats* r: runs)
+        {
+            frames += r->frames.size();
+            if (r->frames.size() != 0)
+            {
+                logSum += log(median(r->frames));
+                medians++;
+            }
+        }
+        printf(
+            "%s: %zu runs, %zu frames, geomean of median frame-times %f\n",
+            host.c_str(), runs.size(), frames, medians > 0 ? exp(logSum / medians) : 0.0);
+    }
 }
 
-float harmonicMean(const std::vector<float>& vals)
+// Baselines are runs in the same format as distributed benchmarks use, one
+// run per line.
+void saveBaseline(const Stats& stats, const char* path)
 {
-    if (vals.size() == 0)
-        return 0.0f;
-
-    float s = 0;
-    for (float v: vals)
-        s += 1.0 / v;
-    return vals.size() / s;
+    FILE* f = fopen(path, "wb");
+    if (!f) panic("Unable to open %s\n", path);
+    for (const RunStats& r: stats.runs)
+        fprintf(f, "%s\n", serializeRun(r).c_str());
+    fclose(f);
+    printf("Saved %zu runs as the baseline in %s\n", stats.runs.size(), path);
 }
 
-float variance(const std::vector<float>& vals)
+std::vector<RunStats> loadBaseline(const char* path)
 {
-    float m = mean(vals);
-    float s = 0;
-    for (float v: vals)
-        s += (m-v) * (m-v);
-    return s / vals.size();
+    std::vector<RunStats> runs;
+    std::istringstream input(readTextFile(path));
+    for (std::string line; std::getline(input, line);)
+    {
+        if (line.empty())
+            continue;
+        RunStats r;
+        if (!deserializeRun(line, r))
+            panic("%s: malformed run on line %zu\n", path, runs.size() + 1);
+        runs.push_back(std::move(r));
+    }
+    return runs;
 }
 
-float collect(const std::vector<float>& vals, const char* cumulative)
+// Runs are only comparable when they rendered the same thing the same way.
+std::string getBaselineKey(const RunStats& r)
 {
-    if (!cumulative)
-        return vals.size() == 0 ? 0 : vals.back();
-    else if (strcmp(cumulative, "sum") == 0)
-        return sum(vals);
-    else if (strcmp(cumulative, "mean") == 0)
-        return mean(vals);
-    else if (strcmp(cumulative, "min") == 0)
-        return min(vals);
-    else if (strcmp(cumulative, "max") == 0)
-        return max(vals);
-    else if (strcmp(cumulative, "median") == 0)
-        return median(vals);
-    else if (strcmp(cumulative, "geomean") == 0)
-        return geomean(vals);
-    else if (strcmp(cumulative, "harmonic-mean") == 0)
-        return harmonicMean(vals);
-    else if (strcmp(cumulative, "variance") == 0)
-        return variance(vals);
-    else if (strcmp(cumulative, "stddev") == 0)
-        return sqrt(variance(vals));
-    else
-        panic("Unknown cumulation prefix %s\n", cumulative);
-    return 0;
+    return r.shaderPath + " [" + r.config + "] " + std::to_string(r.width) + "x" +
+        std::to_string(r.height) + " " + std::to_string(r.threads) + " threads";
 }
 
-struct RunStats
+struct RankTest
 {
-    float buildTime;
-    std::vector<float> frames;
+    double z;
+    // Two-sided.
+    double p;
+    // Rank-biserial correlation, positive when b tends to be larger than a.
+    double effect;
 };
 
-struct Stats
+// Mann-Whitney U test through the normal approximation with a tie and
+// continuity correction. Doesn't assume anything about the shape of the frame
+// time distributions, which are usually skewed and multi-modal.
+RankTest mannWhitneyU(const std::vector<float>& a, const std::vector<float>& b)
 {
-    std::vector<RunStats> runs;
-
-    void clear()
+    std::vector<std::pair<float, int>> all;
+    for (float v: a)
+        all.push_back({v, 0});
+    for (float v: b)
+        all.push_back({v, 1});
+    std::sort(all.begin(), all.end());
+
+    double n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    double rankSumB = 0.0;
+    double tieSum = 0.0;
+    for (size_t i = 0; i < all.size();)
     {
-        runs.clear();
+        size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first)
+            ++j;
+        // Tied values share the average of their 1-based ranks.
+        double rank = (i + j + 1) * 0.5;
+        for (size_t k = i; k < j; ++k)
+            if (all[k].second == 1)
+                rankSumB += rank;
+        double t = j - i;
+        tieSum += t * t * t - t;
+        i = j;
     }
 
-    float getStat(const std::string& spec)
-    {
-        float v = 0;
-        std::vector<std::string> specifiers = splitByWhitespace(spec.c_str());
-
-        if (specifiers.size() == 0)
-            panic("No variable name given!");
+    RankTest test;
+    double u = rankSumB - n2 * (n2 + 1) * 0.5;
+    double mean = n1 * n2 * 0.5;
+    double variance = n1 * n2 / 12.0 * ((n + 1) - tieSum / (n * (n - 1)));
+    double diff = std::max(fabs(u - mean) - 0.5, 0.0);
+    test.z = variance > 0.0 ? std::copysign(diff / sqrt(variance), u - mean) : 0.0;
+    test.p = variance > 0.0 ? erfc(diff / sqrt(variance) / sqrt(2.0)) : 1.0;
+    test.effect = 2.0 * u / (n1 * n2) - 1.0;
+    return test;
+}
 
-        std::string var = specifiers.back();
-        specifiers.pop_back();
+// Compares every run against the baseline run with the same key, in order
+// when there are several. Returns how many runs got significantly slower by
+// more than maxSlowdown (relative change of the median).
+int compareBaseline(const Stats& stats, const char* path, double maxSlowdown, double alpha)
+{
+    std::vector<RunStats> baseline = loadBaseline(path);
+    std::map<std::string, std::deque<const RunStats*>> baselineRuns;
+    for (const RunStats& r: baseline)
+        baselineRuns[getBaselineKey(r)].push_back(&r);
 
-        std::vector<float> stats;
-        if (var == "build-time")
+    int regressions = 0, improvements = 0, compared = 0;
+    for (const RunStats& r: stats.runs)
+    {
+        std::string key = getBaselineKey(r);
+        auto it = baselineRuns.find(key);
+        if (it == baselineRuns.end() || it->second.empty())
         {
-            for (RunStats r: runs)
-                stats.push_back(r.buildTime);
+            printf("%s: not in the baseline\n", key.c_str());
+            continue;
         }
-        else if (var == "frame-time")
+        const RunStats& base = *it->second.front();
+        it->second.pop_front();
+        if (base.frames.size() < 2 || r.frames.size() < 2)
         {
-            const char* cumulation = nullptr;
-            if (specifiers.size() >= 1)
-                cumulation = specifiers.back().c_str();
+            printf("%s: too few frames to compare\n", key.c_str());
+            continue;
+        }
 
-            for (RunStats r: runs)
-                stats.push_back(collect(r.frames, cumulation));
+        double baseMedian = median(base.frames);
+        double newMedian = median(r.frames);
+        double change = baseMedian > 0.0 ? newMedian / baseMedian - 1.0 : 0.0;
+        RankTest test = mannWhitneyU(base.frames, r.frames);
+        bool significant = test.p < alpha;
 
-            if (cumulation)
-                specifiers.pop_back();
+        const char* verdict = "no significant change";
+        if (significant && change > maxSlowdown)
+        {
+            verdict = "REGRESSION";
+            regressions++;
         }
-        else
-            panic("Unknown variable %s\n", var.c_str());
-
-        if (specifiers.size() > 1)
-            panic("Too many cumulation prefixes in \"%s\"!\n", spec.c_str());
+        else if (significant && change < -maxSlowdown)
+        {
+            verdict = "improvement";
+            improvements++;
+        }
+        else if (significant)
+            verdict = change > 0.0 ? "slower, within threshold" : "faster, within threshold";
+        compared++;
 
-        return collect(stats, specifiers.size() == 0 ? nullptr : specifiers.back().c_str());
+        printf(
+            "%s: median frame-time %f -> %f (%+.2f%%), p %.3g, effect %+.3f: %s\n",
+            key.c_str(), baseMedian, newMedian, change * 100.0, test.p, test.effect, verdict);
     }
-};
-
-void benchmarkRenderMain(ViewerResources& res, Stats& stats, const char* shaderPath, int frameCount, double forcedDeltaTime, bool multithreaded)
-{
-    RunStats run;
-
-    std::string shaderSource = readTextFile(shaderPath);
-
-    uint64_t buildStartTicks = SDL_GetTicksNS();
-    if (!loadShaderFromSource(res, shaderSource.c_str(), isPathToGLSL(shaderPath)))
-        panic("Failed to load shader %s\n", shaderPath);
-    uint64_t buildFinishTicks = SDL_GetTicksNS();
-    run.buildTime = (buildFinishTicks-buildStartTicks) * 1e-9;
-
-    auto& params = *res.constants;
-    params.frame = 0;
-    params.mouseX = 0;
-    params.mouseY = 0;
-    params.mouseClickX = 0;
-    params.mouseClickY = 0;
 
-    std::vector<uint32_t> framebuffer;
-    framebuffer.resize(res.surf->w * res.surf->h);
+    printf(
+        "Compared %d runs against %s: %d regressions, %d improvements\n",
+        compared, path, regressions, improvements);
+    return regressions;
+}
 
-    res.globalParams.pixelData = framebuffer.data();
-    res.globalParams.pixelDataSize = framebuffer.size();
-    params.pitch = res.surf->w;
-    params.resX = res.surf->w;
-    params.resY = res.surf->h;
-    params.resZ = 1;
+struct CommandSyntax
+{
+    const char* op;
+    int minArgs;
+    // -1 for no limit.
+    int maxArgs;
+    // Bit i is set when argument i must be a number.
+    uint32_t numericArgs;
+    const char* usage;
+};
 
-    uint64_t startTicks = SDL_GetTicksNS();
-    uint64_t cumulatedTicks = 0;
+static const CommandSyntax COMMAND_SYNTAX[] = {
+    {"framerate", 1, 1, 0b1, "<fps>"},
+    {"clear", 0, 0, 0, ""},
+    {"resolution", 2, 2, 0b11, "<width> <height>"},
+    {"tilesize", 2, 2, 0b11, "<width> <height>"},
+    {"cache", 1, 1, 0, "<dir/off>"},
+    {"capture", 1, 1, 0, "<off/final/every>"},
+    {"dump", 1, 1, 0, "<dir/off>"},
+    {"golden", 1, 2, 0b10, "<path/off> [min-psnr]"},
+    {"scheduler", 1, 1, 0, "<omp/steal>"},
+    {"pipeline", 1, 1, 0, "<off/2/3>"},
+    {"batch", 1, 1, 0b1, "<frames>"},
+    {"threads", 1, 1, 0b1, "<count>"},
+    {"pin", 1, 2, 0, "<off/cpu-list/socket socket-list>"},
+    {"scaling", 2, 3, 0b110, "<shader> <frames> [max-threads]"},
+    {"render", 3, -1, 0b10, "<shader> <frames> <output>"},
+    {"option", 2, -1, 0, "<name> <value>"},
+    {"sweep", 4, -1, 0b10, "<shader> <frames> <option> <values> ..."},
+    {"remarks", 1, 1, 0, "<path>"},
+    {"tile-timing", 1, 1, 0, "<on/off>"},
+    {"heatmap", 1, 1, 0, "<path>"},
+    {"export", 2, 4, 0b1000, "<path> <json/csv> [bootstrap <resamples>]"},
+    {"perf-counters", 1, 1, 0, "<on/off>"},
+    {"perf-raw", 2, 2, 0, "<name> <hex-config>"},
+    {"prebuild", 1, 1, 0, "<on/off>"},
+    {"multithreading", 1, 1, 0, "<on/off>"},
+    {"run", 2, -1, 0b10, "<shader> <frames> [<option> <value> ...]"},
+    {"print", 0, -1, 0, "<text>"},
+    {"baseline", 2, 4, 0b1100, "<save/compare> <path> [max-slowdown-%] [alpha]"},
+};
 
-    for (; params.frame < frameCount; ++params.frame)
+// Catches what would otherwise only fail once the command is reached, maybe
+// after minutes of runs. Done before SDL or Slang are initialized, so that
+// broken lists fail fast. Files and CPU lists are still only checked when
+// they're used.
+void validateCommandList(const std::vector<BenchmarkCommand>& commands)
+{
+    for (const BenchmarkCommand& c: commands)
     {
-        uint64_t curTicks = SDL_GetTicksNS();
-        uint64_t deltaTicks = curTicks - startTicks;
-        if (forcedDeltaTime > 0)
-            deltaTicks = round(forcedDeltaTime * 1e9);
-
-        if (params.frame != 0)
-            cumulatedTicks += deltaTicks;
+        const CommandSyntax* syntax = nullptr;
+        for (const CommandSyntax& s: COMMAND_SYNTAX)
+            if (c.op == s.op)
+                syntax = &s;
+        if (!syntax)
+            panic("Unrecognized command %s\n", c.op.c_str());
+
+        int count = c.args.size();
+        if (count < syntax->minArgs || (syntax->maxArgs >= 0 && count > syntax->maxArgs))
+            panic("%s: expected %s, got \"%s\"\n", syntax->op, syntax->usage, c.text.c_str());
+
+        double val;
+        for (int i = 0; i < count && i < 32; ++i)
+        {
+            if ((syntax->numericArgs >> i & 1) && !readDouble(c.args[i], val))
+                panic("%s: expected number in argument %d\n", syntax->op, i+1);
+        }
 
-        startTicks = curTicks;
-        params.time = cumulatedTicks * 1e-9;
+        auto checkValue = [&](const std::string& value, std::initializer_list<const char*> allowed)
+        {
+            for (const char* a: allowed)
+                if (value == a)
+                    return;
+            panic("%s: expected %s, got %s\n", syntax->op, syntax->usage, value.c_str());
+        };
 
-        // Avoid getting the "program is unresponsive" message.
-        SDL_Event event;
-        while (SDL_PollEvent(&event))
+        ShaderOptions test;
+        if (c.op == "capture")
+            checkValue(c.args[0], {"off", "final", "every"});
+        else if (c.op == "scheduler")
+            checkValue(c.args[0], {"omp", "steal"});
+        else if (c.op == "pipeline")
+            checkValue(c.args[0], {"off", "1", "2", "3"});
+        else if (c.op == "baseline")
         {
-            switch (event.type)
+            checkValue(c.args[0], {"save", "compare"});
+            if (c.args[0] == "save" && count != 2)
+                panic("baseline: save only takes a path\n");
+        }
+        else if (c.op == "export")
+        {
+            checkValue(c.args[1], {"json", "csv"});
+            if (count == 3 || (count == 4 && c.args[2] != "bootstrap"))
+                panic("export: expected %s\n", syntax->usage);
+        }
+        else if (c.op == "pin" && count == 2 && c.args[0] != "socket")
+            panic("pin: expected %s\n", syntax->usage);
+        else if (c.op == "tilesize" && !parseTileSize(c.args, test))
+            panic("tilesize: expected positive width and height with at most %d threads per tile\n", MAX_TILE_THREADS);
+        else if (c.op == "option" && !parseShaderOptionCommand(c, test))
+            panic("option: unknown option or value in \"%s\"\n", c.text.c_str());
+        else if (c.op == "batch" && atof(c.args[0].c_str()) < 1)
+            panic("batch takes a frame count of at least 1, not %s\n", c.args[0].c_str());
+        else if (c.op == "sweep")
+        {
+            if (count % 2 != 0)
+                panic("sweep: expected %s\n", syntax->usage);
+            for (int i = 2; i < count; i += 2)
             {
-            case SDL_EVENT_QUIT:
-                panic("User interrupted benchmark.");
-                break;
+                std::stringstream values(c.args[i+1]);
+                for (std::string value; std::getline(values, value, ',');)
+                    if (!setShaderOption(test, c.args[i], value))
+                        panic("sweep: unknown option %s or value %s\n", c.args[i].c_str(), value.c_str());
+            }
+        }
+        else if (c.op == "run")
+        {
+            if (count % 2 != 0)
+                panic("run: expected %s\n", syntax->usage);
+            for (int i = 2; i < count; i += 2)
+            {
+                const std::string& name = c.args[i];
+                if (name != "warmup" && name != "until-cv" && name != "max" && name != "reject")
+                    panic("run: unknown option %s\n", name.c_str());
+                if (!readDouble(c.args[i+1], val))
+                    panic("run: expected number in argument %d\n", i+2);
             }
         }
-
-        uint64_t renderStartTicks = SDL_GetTicksNS();
-        if (multithreaded)
-            renderFrameMultithread(res, res.surf->w, res.surf->h);
-        else
-            renderFrameSinglethread(res, res.surf->w, res.surf->h);
-        uint64_t renderFinishTicks = SDL_GetTicksNS();
-
-        float frameTime = (renderFinishTicks - renderStartTicks) * 1e-9;
-        run.frames.push_back(frameTime);
-
-        SDL_LockSurface(res.surf);
-        SDL_ConvertPixels(
-            res.surf->w, res.surf->h, SDL_PIXELFORMAT_ABGR8888, framebuffer.data(),
-            res.surf->w * 4, res.surf->format, res.surf->pixels, res.surf->pitch);
-        SDL_UnlockSurface(res.surf);
-
-        SDL_UpdateWindowSurface(res.window);
     }
-
-    stats.runs.emplace_back(run);
 }
 
-void benchmarkMain(const char* commandListPath)
+// Returns the exit code, non-zero when a run didn't match its golden image.
+int benchmarkMain(const char* commandListPath, bool headless, const BenchmarkDistribution& dist = BenchmarkDistribution())
 {
     Stats stats;
-    ViewerResources res = init();
-    loadShader(res, nullptr);
+    uint64_t parseStartTicks = SDL_GetTicksNS();
+    std::vector<BenchmarkCommand> commands = parseCommandList(commandListPath);
+    validateCommandList(commands);
+    if (dist.role == BenchmarkRole::WORKER)
+        shardCommands(commands, dist.shardIndex, dist.shardCount);
+    uint64_t sdlInitStartTicks = SDL_GetTicksNS();
+    stats.parseTime = (sdlInitStartTicks - parseStartTicks) * 1e-9;
+
+    // No fallback shader, every run loads its own.
+    ViewerResources res = init(headless);
+    stats.sdlInitTime = (SDL_GetTicksNS() - sdlInitStartTicks) * 1e-9;
+
+    std::map<size_t, std::vector<RunStats>> remoteRuns;
+    if (dist.role == BenchmarkRole::COORDINATOR)
+    {
+        if (!runBenchmarkWorkers(commandListPath, dist, remoteRuns, stats.buildWallclock))
+            panic("Distributed benchmark failed\n");
+        // Replaced by what the workers recorded.
+        for (BenchmarkCommand& c: commands)
+            if (c.op != "clear" && c.op != "print" && c.op != "export" && c.op != "remarks" && c.op != "baseline")
+                c.op = "remote";
+    }
 
-    std::string commandList = readTextFile(commandListPath);
-    std::istringstream input(commandList);
+    PrebuiltShaders prebuilt;
+    stats.buildWallclock += prebuildShaders(commands, res.shaderOptions, prebuilt);
+    // Prebuild threads create their global sessions concurrently.
+    for (auto& compiler: prebuilt.compilers)
+        stats.globalSessionTime = std::max(stats.globalSessionTime, compiler->globalSessionTime);
 
     double forcedDeltaTime = -1.0;
     bool multithreaded = true;
+    int regressions = 0;
 
-    for (std::string command; std::getline(input, command);)
+    for (size_t commandIndex = 0; commandIndex < commands.size(); ++commandIndex)
     {
-        // Strip whitespace from command
-        const char* cmd = command.c_str();
-        skipWhitespace(cmd);
-
-        // Skip comments
-        if (*cmd == '#' || !*cmd)
-            continue;
-
-        // Read operation
-        std::string op = readUntilWhitespace(cmd);
-
-        // Skip first space after command, this is important for 'print'.
-        if (*cmd) cmd++;
-
-        std::vector<std::string> args = splitByWhitespace(cmd);
+        size_t runsBefore = stats.runs.size();
+        const std::string& op = commands[commandIndex].op;
+        const std::vector<std::string>& args = commands[commandIndex].args;
+        const char* cmd = commands[commandIndex].text.c_str();
 
         auto checkArgCount = [&](int count)
         {
@@ -767,11 +5949,222 @@ void benchmarkMain(const char* commandListPath)
             w = w > 8192 ? 8192 : w;
             h = h > 8192 ? 8192 : h;
 
-            w = (w+DISPATCH_TILE_SIZE-1)/DISPATCH_TILE_SIZE*DISPATCH_TILE_SIZE;
-            h = (h+DISPATCH_TILE_SIZE-1)/DISPATCH_TILE_SIZE*DISPATCH_TILE_SIZE;
-
             setResolution(res, w, h);
         }
+        else if (op == "tilesize")
+        {
+            checkArgCount(2);
+            if (!parseTileSize(args, res.shaderOptions))
+            {
+                panic(
+                    "tilesize: expected positive width and height with at most %d threads per tile\n",
+                    MAX_TILE_THREADS);
+            }
+        }
+        else if (op == "cache")
+        {
+            checkArgCount(1);
+            res.compiler.cacheDir = openCacheDir(args[0]);
+        }
+        else if (op == "capture")
+        {
+            checkArgCount(1);
+            if (args[0] == "off")
+                res.outputCheck.capture = FrameCapture::OFF;
+            else if (args[0] == "final")
+                res.outputCheck.capture = FrameCapture::FINAL;
+            else if (args[0] == "every")
+                res.outputCheck.capture = FrameCapture::EVERY;
+            else
+                panic("capture: expected off, final or every\n");
+        }
+        else if (op == "dump")
+        {
+            checkArgCount(1);
+            res.outputCheck.dumpDir = args[0] == "off" ? "" : args[0];
+            std::error_code ec;
+            if (!res.outputCheck.dumpDir.empty() && !std::filesystem::create_directories(args[0], ec) && ec)
+                panic("Unable to create dump directory %s\n", args[0].c_str());
+        }
+        else if (op == "golden")
+        {
+            if (args.size() < 1 || args.size() > 2)
+                panic("golden: expected <path/off> [min-psnr]\n");
+            res.outputCheck.goldenPath = args[0] == "off" ? "" : args[0];
+            if (args.size() == 2)
+                res.outputCheck.minPSNR = argDouble(1);
+        }
+        else if (op == "scheduler")
+        {
+            checkArgCount(1);
+            if (args[0] == "omp")
+                res.scheduler = TileScheduler::OMP;
+            else if (args[0] == "steal")
+                res.scheduler = TileScheduler::STEAL;
+            else
+                panic("Unknown scheduler %s\n", args[0].c_str());
+        }
+        else if (op == "pipeline")
+        {
+            checkArgCount(1);
+            int buffers = args[0] == "off" ? 1 : int(argDouble(0));
+            if (buffers < 1 || buffers > 3)
+                panic("pipeline takes off, 2 or 3, not %s\n", args[0].c_str());
+            startFramePresenter(res, buffers);
+        }
+        else if (op == "batch")
+        {
+            checkArgCount(1);
+            int frames = int(argDouble(0));
+            if (frames < 1)
+                panic("batch takes a frame count of at least 1, not %s\n", args[0].c_str());
+            res.frameBatch = frames;
+        }
+        else if (op == "threads")
+        {
+            checkArgCount(1);
+            res.threadCount = std::max(int(argDouble(0)), 0);
+            applyThreadConfig(res);
+        }
+        else if (op == "pin")
+        {
+            std::vector<int> cpus;
+            if (args.size() == 1 && args[0] != "off")
+            {
+                if (!parseIndexList(args[0], cpus))
+                    panic("pin: invalid CPU list %s\n", args[0].c_str());
+            }
+            else if (args.size() == 2 && args[0] == "socket")
+            {
+                std::vector<int> sockets;
+                if (!parseIndexList(args[1], sockets))
+                    panic("pin: invalid socket list %s\n", args[1].c_str());
+                for (int socket: sockets)
+                {
+                    std::vector<int> socketCpus = getSocketCpus(socket);
+                    if (socketCpus.size() == 0)
+                        panic("pin: no CPUs found for socket %d\n", socket);
+                    cpus.insert(cpus.end(), socketCpus.begin(), socketCpus.end());
+                }
+            }
+            else if (args.size() != 1)
+                panic("pin: expected off, a CPU list or socket <list>\n");
+
+            res.pinnedCpus = cpus;
+            applyThreadConfig(res);
+        }
+        else if (op == "scaling")
+        {
+            if (args.size() != 2 && args.size() != 3)
+                panic("Incorrect number of arguments for scaling: expected 2 or 3, got %d\n", (int)args.size());
+            int numFrames = int(argDouble(1));
+            int maxThreads = args.size() == 3 ?
+                int(argDouble(2)) : std::max(1u, std::thread::hardware_concurrency());
+            benchmarkScalingMain(res, stats, args[0].c_str(), numFrames, maxThreads, forcedDeltaTime);
+        }
+        else if (op == "render")
+        {
+            if (args.size() < 3)
+                panic("render: expected <shader> <frames> <output>\n");
+
+            // The output is the rest of the line, so that pipes can have
+            // arguments.
+            std::string outPath = getCommandRest(commands[commandIndex], 2);
+
+            renderVideoMain(
+                res, stats, args[0].c_str(), int(argDouble(1)), outPath.c_str(),
+                forcedDeltaTime, multithreaded);
+        }
+        else if (op == "option")
+        {
+            if (!parseShaderOptionCommand(commands[commandIndex], res.shaderOptions))
+                panic("option: unknown option or value in \"%s\"\n", cmd);
+        }
+        else if (op == "sweep")
+        {
+            if (args.size() < 4 || args.size() % 2 != 0)
+                panic("sweep: expected <path> <frames> followed by <option> <values> pairs\n");
+
+            std::vector<SweepAxis> axes;
+            for (size_t i = 2; i < args.size(); i += 2)
+            {
+                SweepAxis axis;
+                axis.option = args[i];
+                std::stringstream values(args[i+1]);
+                for (std::string value; std::getline(values, value, ',');)
+                {
+                    ShaderOptions test;
+                    if (!setShaderOption(test, axis.option, value))
+                        panic("sweep: unknown option %s or value %s\n", axis.option.c_str(), value.c_str());
+                    axis.values.push_back(value);
+                }
+                if (axis.values.size() == 0)
+                    panic("sweep: no values given for %s\n", axis.option.c_str());
+                axes.push_back(axis);
+            }
+            benchmarkSweepMain(res, stats, args[0].c_str(), int(argDouble(1)), axes, forcedDeltaTime, multithreaded);
+        }
+        else if (op == "remarks")
+        {
+            checkArgCount(1);
+            if (stats.runs.size() == 0)
+                panic("remarks: no run to write the remarks of\n");
+            const std::string& remarks = stats.runs.back().remarks;
+            writeBinaryFile(args[0].c_str(), remarks.data(), remarks.size());
+        }
+        else if (op == "tile-timing")
+        {
+            checkArgCount(1);
+            res.tileTiming.enabled = args[0] == "on" || args[0] == "true";
+        }
+        else if (op == "heatmap")
+        {
+            checkArgCount(1);
+            writeTileTiming(res.tileTiming, args[0].c_str());
+        }
+        else if (op == "export")
+        {
+            if (args.size() != 2 && !(args.size() == 4 && args[2] == "bootstrap"))
+                panic("export: expected <path> <json/csv> [bootstrap <resamples>]\n");
+
+            int resamples = args.size() == 4 ? int(argDouble(3)) : 0;
+            HostInfo host = getHostInfo(res);
+            if (args[1] == "json")
+                exportStatsJSON(stats, host, args[0].c_str(), resamples);
+            else if (args[1] == "csv")
+                exportStatsCSV(stats, host, args[0].c_str(), resamples);
+            else
+                panic("export: unknown format %s\n", args[1].c_str());
+        }
+        else if (op == "perf-counters")
+        {
+            checkArgCount(1);
+            res.perfCounters.enabled = args[0] == "on" || args[0] == "true";
+#ifndef __linux__
+            if (res.perfCounters.enabled)
+                panic("perf-counters: only supported on Linux\n");
+#endif
+            if (res.perfCounters.descs.size() == 0)
+                res.perfCounters.descs = getDefaultPerfCounters();
+        }
+        else if (op == "perf-raw")
+        {
+            checkArgCount(2);
+            if (res.perfCounters.descs.size() == 0)
+                res.perfCounters.descs = getDefaultPerfCounters();
+            char* end = nullptr;
+            uint64_t config = strtoull(args[1].c_str(), &end, 16);
+            if (*end != 0)
+                panic("perf-raw: expected hexadecimal event config, got %s\n", args[1].c_str());
+#ifdef __linux__
+            res.perfCounters.descs.push_back({args[0], PERF_TYPE_RAW, config});
+#endif
+        }
+        else if (op == "prebuild")
+        {
+            // Already handled by prebuildShaders().
+            checkArgCount(1);
+        }
         else if (op == "multithreading")
         {
             checkArgCount(1);
@@ -782,62 +6175,149 @@ void benchmarkMain(const char* commandListPath)
         }
         else if (op == "run")
         {
-            checkArgCount(2);
-            int numFrames = int(argDouble(1));
-            benchmarkRenderMain(res, stats, args[0].c_str(), numFrames, forcedDeltaTime, multithreaded);
+            if (args.size() < 2 || args.size() % 2 != 0)
+                panic("run: expected <shader> <frames> followed by <option> <value> pairs\n");
+
+            RunOptions opts;
+            opts.frames = int(argDouble(1));
+            for (size_t i = 2; i < args.size(); i += 2)
+            {
+                double value = argDouble(i+1);
+                if (args[i] == "warmup")
+                    opts.warmup = std::max(int(value), 0);
+                else if (args[i] == "until-cv")
+                    opts.untilCV = value;
+                else if (args[i] == "max")
+                    opts.maxFrames = std::max(int(value), 0);
+                else if (args[i] == "reject")
+                    opts.rejectOutliers = value;
+                else
+                    panic("run: unknown option %s\n", args[i].c_str());
+            }
+            if (opts.untilCV > 0.0 && opts.maxFrames == 0)
+                opts.maxFrames = std::max(opts.frames, 1) * UNTIL_CV_MAX_FACTOR;
+
+            auto it = prebuilt.shaders.find(commandIndex);
+            benchmarkRenderMain(
+                res, stats, args[0].c_str(),
+                it == prebuilt.shaders.end() ? nullptr : &it->second,
+                opts, forcedDeltaTime, multithreaded);
         }
         else if (op == "print")
         {
             std::string output;
-
-            while (*cmd != 0)
+            for (const PrintSegment& segment: commands[commandIndex].print)
             {
-                if (cmd[0] == '$' && cmd[1] == '{')
-                {
-                    std::string spec;
-                    cmd += 2;
-                    while (*cmd && *cmd != '}')
-                    {
-                        spec += *cmd;
-                        cmd++;
-                    }
-
-                    if (*cmd == '}')
-                        cmd++;
-
-                    output += std::to_string(stats.getStat(spec));
-                }
+                if (segment.isStat)
+                    output += std::to_string(stats.getStat(segment.stat));
                 else
-                {
-                    output.push_back(*cmd);
-                    cmd++;
-                }
+                    output += segment.text;
             }
 
             printf("%s\n", output.c_str());
         }
+        else if (op == "baseline")
+        {
+            if (args.size() < 2 || args.size() > 4)
+                panic("baseline: expected <save/compare> <path> [max-slowdown-%%] [alpha]\n");
+            if (args[0] == "save")
+                saveBaseline(stats, args[1].c_str());
+            else if (args[0] == "compare")
+            {
+                double maxSlowdown = args.size() >= 3 ? argDouble(2) * 0.01 : 0.05;
+                double alpha = args.size() == 4 ? argDouble(3) : 0.01;
+                regressions += compareBaseline(stats, args[1].c_str(), maxSlowdown, alpha);
+            }
+            else
+                panic("baseline: expected save or compare, got %s\n", args[0].c_str());
+        }
+        else if (op == "remote")
+        {
+            auto it = remoteRuns.find(commandIndex);
+            if (it != remoteRuns.end())
+            {
+                for (RunStats& run: it->second)
+                {
+                    res.outputCheck.mismatches += run.outputMismatch ? 1 : 0;
+                    stats.runs.push_back(std::move(run));
+                }
+            }
+        }
         else
         {
             panic("Unrecognized command %s\n", op.c_str());
         }
+
+        if (dist.role == BenchmarkRole::WORKER)
+        {
+            for (size_t i = runsBefore; i < stats.runs.size(); ++i)
+                printf("@@run %zu %s\n", commandIndex, serializeRun(stats.runs[i]).c_str());
+            fflush(stdout);
+        }
+    }
+
+    if (dist.role == BenchmarkRole::WORKER)
+    {
+        printf("@@build-wallclock %.9g\n", stats.buildWallclock);
+        // Mismatches are counted by the coordinator.
+        deinit(res);
+        return 0;
     }
+    if (dist.role == BenchmarkRole::COORDINATOR)
+        printHostSummary(stats);
 
+    int mismatches = res.outputCheck.mismatches;
     deinit(res);
+    if (mismatches > 0)
+        printf("%d run(s) didn't match the golden image\n", mismatches);
+    if (regressions > 0)
+        printf("%d run(s) regressed against the baseline\n", regressions);
+    return mismatches > 0 || regressions > 0 ? 1 : 0;
 }
 
 int main(int argc, char** argv)
 {
+    saveProcessAffinity();
     if (argc <= 1)
     {
         // No args, interactive mode.
-        interactiveMain();
+        interactiveMain(nullptr);
         return 0;
     }
-    else if (argc == 2)
+    else if (argc == 3 && strcmp(argv[1], "--frame-stats") == 0)
     {
-        benchmarkMain(argv[1]);
+        interactiveMain(argv[2]);
         return 0;
     }
+    else if (argc == 2)
+    {
+        return benchmarkMain(argv[1], false);
+    }
+    else if (argc == 3 && strcmp(argv[1], "--headless") == 0)
+    {
+        return benchmarkMain(argv[2], true);
+    }
+    else if (argc == 4 && strcmp(argv[1], "--worker") == 0)
+    {
+        BenchmarkDistribution dist;
+        dist.role = BenchmarkRole::WORKER;
+        if (sscanf(argv[2], "%d/%d", &dist.shardIndex, &dist.shardCount) != 2 ||
+            dist.shardCount < 1 || dist.shardIndex < 0 || dist.shardIndex >= dist.shardCount)
+            panic("--worker: expected <index>/<count>, got %s\n", argv[2]);
+        return benchmarkMain(argv[3], true, dist);
+    }
+    else if (argc >= 4 && strcmp(argv[1], "--coordinate") == 0)
+    {
+        BenchmarkDistribution dist;
+        dist.role = BenchmarkRole::COORDINATOR;
+        dist.hosts.assign(argv + 3, argv + argc);
+        // Workers run the same binary, from the same path.
+        std::error_code ec;
+        dist.executable = std::filesystem::canonical("/proc/self/exe", ec).string();
+        if (ec)
+            dist.executable = std::filesystem::absolute(argv[0]).string();
+        return benchmarkMain(argv[2], true, dist);
+    }
     else
     {
         printUsage(stdout, argv[0]);